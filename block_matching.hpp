@@ -0,0 +1,299 @@
+//MIT License
+//
+//Copyright(c) 2025 Alex Kasitskyi
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files(the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions :
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+#include "cpu_dispatch.hpp"
+
+// Sum of absolute differences of two square blocks, the core of block matching.
+// Kernels are specialized on block size, so all loops over a row are fully unrolled.
+// x86 kernels are all compiled in and picked at runtime, see cpu_dispatch.hpp.
+// There are no SSD kernels: every matcher compares SADs, and the successive elimination bound
+// |sum(a) - sum(b)| <= SAD has no SSD counterpart that is as cheap.
+
+typedef int (*SadFunction)(const uint8_t* a, int aStride, const uint8_t* b, int bStride);
+
+// SAD with early exit: the partial sum is checked every quarter of the block, and once it reaches limit
+// the partial sum is returned. So the result is exact only when it's below limit.
+typedef int (*SadLimitFunction)(const uint8_t* a, int aStride, const uint8_t* b, int bStride, int limit);
+
+inline int sad_scalar(const uint8_t* a, int aStride, const uint8_t* b, int bStride, int size) {
+	int sum = 0;
+	for (int i = 0; i < size; i++, a += aStride, b += bStride) {
+		for (int j = 0; j < size; j++) {
+			sum += std::abs(int(a[j]) - int(b[j]));
+		}
+	}
+	return sum;
+}
+
+template<int Size>
+int sad_scalar(const uint8_t* a, int aStride, const uint8_t* b, int bStride) {
+	return sad_scalar(a, aStride, b, bStride, Size);
+}
+
+template<int Size>
+int sad_limit_scalar(const uint8_t* a, int aStride, const uint8_t* b, int bStride, int limit) {
+	constexpr int step = Size / 4;
+
+	int sum = 0;
+	for (int i = 0; i < Size; i++, a += aStride, b += bStride) {
+		for (int j = 0; j < Size; j++) {
+			sum += std::abs(int(a[j]) - int(b[j]));
+		}
+		if ((i + 1) % step == 0 && sum >= limit) {
+			break;
+		}
+	}
+	return sum;
+}
+
+#ifdef FFSTAB_X86
+
+template<int Size>
+FFSTAB_TARGET("sse2") int sad_sse2(const uint8_t* a, int aStride, const uint8_t* b, int bStride) {
+	static_assert(Size % 16 == 0);
+
+	__m128i acc = _mm_setzero_si128();
+	for (int i = 0; i < Size; i++, a += aStride, b += bStride) {
+		for (int j = 0; j < Size; j += 16) {
+			const __m128i va = _mm_loadu_si128((const __m128i*)(a + j));
+			const __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+			acc = _mm_add_epi32(acc, _mm_sad_epu8(va, vb));
+		}
+	}
+	return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+}
+
+// 16 byte row tails of two consecutive rows are packed into one 32 byte vector
+template<int Size, int Rows>
+FFSTAB_TARGET_AVX2 inline int sad_avx2_rows(const uint8_t* a, int aStride, const uint8_t* b, int bStride) {
+	static_assert(Size % 16 == 0 && Rows % 2 == 0);
+
+	constexpr int body = Size / 32 * 32;
+
+	__m256i acc = _mm256_setzero_si256();
+	for (int i = 0; i < Rows; i += 2, a += 2 * aStride, b += 2 * bStride) {
+		for (int j = 0; j < body; j += 32) {
+			acc = _mm256_add_epi32(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a + j)), _mm256_loadu_si256((const __m256i*)(b + j))));
+			acc = _mm256_add_epi32(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a + aStride + j)), _mm256_loadu_si256((const __m256i*)(b + bStride + j))));
+		}
+		if constexpr (body != Size) {
+			const __m256i va = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(a + body))), _mm_loadu_si128((const __m128i*)(a + aStride + body)), 1);
+			const __m256i vb = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(b + body))), _mm_loadu_si128((const __m128i*)(b + bStride + body)), 1);
+			acc = _mm256_add_epi32(acc, _mm256_sad_epu8(va, vb));
+		}
+	}
+	const __m128i acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	return _mm_cvtsi128_si32(acc128) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc128, acc128));
+}
+
+template<int Size>
+FFSTAB_TARGET_AVX2 int sad_avx2(const uint8_t* a, int aStride, const uint8_t* b, int bStride) {
+	return sad_avx2_rows<Size, Size>(a, aStride, b, bStride);
+}
+
+template<int Size>
+FFSTAB_TARGET("sse2") int sad_limit_sse2(const uint8_t* a, int aStride, const uint8_t* b, int bStride, int limit) {
+	static_assert(Size % 16 == 0);
+	constexpr int step = Size / 4;
+
+	__m128i acc = _mm_setzero_si128();
+	int sum = 0;
+	for (int i = 0; i < Size; i += step) {
+		for (int k = 0; k < step; k++, a += aStride, b += bStride) {
+			for (int j = 0; j < Size; j += 16) {
+				acc = _mm_add_epi32(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + j)), _mm_loadu_si128((const __m128i*)(b + j))));
+			}
+		}
+		sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+		if (sum >= limit) {
+			break;
+		}
+	}
+	return sum;
+}
+
+template<int Size>
+FFSTAB_TARGET_AVX2 int sad_limit_avx2(const uint8_t* a, int aStride, const uint8_t* b, int bStride, int limit) {
+	static_assert(Size % 16 == 0);
+	constexpr int step = Size / 4;
+
+	int sum = 0;
+	for (int i = 0; i < Size; i += step, a += step * aStride, b += step * bStride) {
+		sum += sad_avx2_rows<Size, step>(a, aStride, b, bStride);
+		if (sum >= limit) {
+			break;
+		}
+	}
+	return sum;
+}
+
+// Only for rows of whole 64 byte vectors, masked loads for narrower rows are slower than AVX2
+template<int Size>
+FFSTAB_TARGET_AVX512 int sad_avx512(const uint8_t* a, int aStride, const uint8_t* b, int bStride) {
+	static_assert(Size % 64 == 0);
+
+	__m512i acc = _mm512_setzero_si512();
+	for (int i = 0; i < Size; i++, a += aStride, b += bStride) {
+		for (int j = 0; j < Size; j += 64) {
+			const __m512i va = _mm512_loadu_si512((const void*)(a + j));
+			const __m512i vb = _mm512_loadu_si512((const void*)(b + j));
+			acc = _mm512_add_epi64(acc, _mm512_sad_epu8(va, vb));
+		}
+	}
+	return (int)_mm512_reduce_add_epi64(acc);
+}
+
+#endif
+
+#ifdef FFSTAB_NEON
+
+template<int Size>
+int sad_neon(const uint8_t* a, int aStride, const uint8_t* b, int bStride) {
+	static_assert(Size % 16 == 0);
+
+	uint32x4_t acc = vdupq_n_u32(0);
+	for (int i = 0; i < Size; i++, a += aStride, b += bStride) {
+		uint16x8_t row = vdupq_n_u16(0);
+		for (int j = 0; j < Size; j += 16) {
+			row = vpadalq_u8(row, vabdq_u8(vld1q_u8(a + j), vld1q_u8(b + j)));
+		}
+		acc = vpadalq_u16(acc, row);
+	}
+	const uint64x2_t sum = vpaddlq_u32(acc);
+	return int(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+}
+
+template<int Size>
+int sad_limit_neon(const uint8_t* a, int aStride, const uint8_t* b, int bStride, int limit) {
+	static_assert(Size % 16 == 0);
+	constexpr int step = Size / 4;
+
+	uint32x4_t acc = vdupq_n_u32(0);
+	int sum = 0;
+	for (int i = 0; i < Size; i += step) {
+		for (int k = 0; k < step; k++, a += aStride, b += bStride) {
+			uint16x8_t row = vdupq_n_u16(0);
+			for (int j = 0; j < Size; j += 16) {
+				row = vpadalq_u8(row, vabdq_u8(vld1q_u8(a + j), vld1q_u8(b + j)));
+			}
+			acc = vpadalq_u16(acc, row);
+		}
+		const uint64x2_t total = vpaddlq_u32(acc);
+		sum = int(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1));
+		if (sum >= limit) {
+			break;
+		}
+	}
+	return sum;
+}
+
+#endif
+
+struct SadKernel {
+	std::string isa;
+	int blockSize = 0;
+	SadFunction function = nullptr;
+};
+
+// All kernels for the given block size that the CPU supports, the scalar one first and the fastest one last.
+// Empty for block sizes without specialized kernels.
+inline std::vector<SadKernel> sad_kernels(int blockSize) {
+	std::vector<SadKernel> kernels;
+
+	auto add = [&](const std::string& isa, SadFunction f16, SadFunction f32, SadFunction f48, SadFunction f64) {
+		SadFunction f = nullptr;
+		switch (blockSize) {
+		case 16: f = f16; break;
+		case 32: f = f32; break;
+		case 48: f = f48; break;
+		case 64: f = f64; break;
+		}
+		if (f) {
+			kernels.push_back({ isa, blockSize, f });
+		}
+	};
+
+	const CpuIsa isa = cpu_isa();
+
+	add("scalar", sad_scalar<16>, sad_scalar<32>, sad_scalar<48>, sad_scalar<64>);
+#ifdef FFSTAB_X86
+	if (isa == CpuIsa::sse2 || isa == CpuIsa::avx2 || isa == CpuIsa::avx512) {
+		add("sse2", sad_sse2<16>, sad_sse2<32>, sad_sse2<48>, sad_sse2<64>);
+	}
+	if (isa == CpuIsa::avx2 || isa == CpuIsa::avx512) {
+		add("avx2", sad_avx2<16>, sad_avx2<32>, sad_avx2<48>, sad_avx2<64>);
+	}
+	if (isa == CpuIsa::avx512) {
+		add("avx512", nullptr, nullptr, nullptr, sad_avx512<64>);
+	}
+#endif
+#ifdef FFSTAB_NEON
+	add("neon", sad_neon<16>, sad_neon<32>, sad_neon<48>, sad_neon<64>);
+#endif
+
+	return kernels;
+}
+
+// Fastest kernel for the block size, nullptr if there's no specialized one
+inline SadFunction best_sad_function(int blockSize) {
+	const std::vector<SadKernel> kernels = sad_kernels(blockSize);
+	return kernels.empty() ? nullptr : kernels.back().function;
+}
+
+// Fastest early exit kernel for the block size, nullptr if there's no specialized one.
+// AVX-512 CPUs use the AVX2 version, the early exit checks leave too little work per 64 byte row.
+inline SadLimitFunction best_sad_limit_function(int blockSize) {
+	auto pick = [&](SadLimitFunction f16, SadLimitFunction f32, SadLimitFunction f48, SadLimitFunction f64) -> SadLimitFunction {
+		switch (blockSize) {
+		case 16: return f16;
+		case 32: return f32;
+		case 48: return f48;
+		case 64: return f64;
+		default: return nullptr;
+		}
+	};
+
+	const CpuIsa isa = cpu_isa();
+
+#ifdef FFSTAB_X86
+	if (isa == CpuIsa::avx2 || isa == CpuIsa::avx512) {
+		return pick(sad_limit_avx2<16>, sad_limit_avx2<32>, sad_limit_avx2<48>, sad_limit_avx2<64>);
+	}
+	if (isa == CpuIsa::sse2) {
+		return pick(sad_limit_sse2<16>, sad_limit_sse2<32>, sad_limit_sse2<48>, sad_limit_sse2<64>);
+	}
+#endif
+#ifdef FFSTAB_NEON
+	if (isa == CpuIsa::neon) {
+		return pick(sad_limit_neon<16>, sad_limit_neon<32>, sad_limit_neon<48>, sad_limit_neon<64>);
+	}
+#endif
+
+	return pick(sad_limit_scalar<16>, sad_limit_scalar<32>, sad_limit_scalar<48>, sad_limit_scalar<64>);
+}
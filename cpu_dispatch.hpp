@@ -0,0 +1,149 @@
+//MIT License
+//
+//Copyright(c) 2025 Alex Kasitskyi
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files(the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions :
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+#pragma once
+
+#include <string>
+
+// Runtime CPU dispatch. Hot kernels are compiled for several instruction sets in the same binary,
+// and the best one supported by the CPU is picked once at startup, so builds don't need -march=native.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FFSTAB_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FFSTAB_NEON 1
+#include <arm_neon.h>
+#endif
+
+// GCC and Clang need the instruction set enabled per function to use its intrinsics and to auto-vectorize for it.
+// MSVC allows any intrinsic anywhere, but can't compile generic code for a specific ISA.
+#if defined(FFSTAB_X86) && (defined(__GNUC__) || defined(__clang__))
+#define FFSTAB_TARGET_CLONES 1
+#define FFSTAB_TARGET(isa) __attribute__((target(isa)))
+#define FFSTAB_FLATTEN __attribute__((flatten))
+#define FFSTAB_INLINE inline __attribute__((always_inline))
+#else
+#define FFSTAB_TARGET(isa)
+#define FFSTAB_FLATTEN
+#define FFSTAB_INLINE inline
+#endif
+
+#define FFSTAB_TARGET_AVX2 FFSTAB_TARGET("avx2,fma,bmi2")
+#define FFSTAB_TARGET_AVX512 FFSTAB_TARGET("avx512f,avx512bw,avx512vl,avx512dq,avx2,fma,bmi2")
+
+enum class CpuIsa {
+	scalar,
+	sse2,
+	avx2,
+	avx512,
+	neon
+};
+
+inline const char* cpu_isa_name(CpuIsa isa) {
+	switch (isa) {
+	case CpuIsa::sse2: return "sse2";
+	case CpuIsa::avx2: return "avx2";
+	case CpuIsa::avx512: return "avx512";
+	case CpuIsa::neon: return "neon";
+	default: return "scalar";
+	}
+}
+
+inline CpuIsa detect_cpu_isa() {
+#if defined(FFSTAB_X86) && (defined(__GNUC__) || defined(__clang__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq")) {
+		return CpuIsa::avx512;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("bmi2")) {
+		return CpuIsa::avx2;
+	}
+	return __builtin_cpu_supports("sse2") ? CpuIsa::sse2 : CpuIsa::scalar;
+#elif defined(FFSTAB_X86) && defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 0);
+	const int maxLeaf = regs[0];
+	__cpuid(regs, 1);
+	const bool sse2 = (regs[3] >> 26) & 1;
+	const bool fma = (regs[2] >> 12) & 1;
+	const bool osxsave = (regs[2] >> 27) & 1;
+	const bool avx = (regs[2] >> 28) & 1;
+	if (!osxsave || !avx || maxLeaf < 7) {
+		return sse2 ? CpuIsa::sse2 : CpuIsa::scalar;
+	}
+	// The OS must save ymm (and zmm) registers on context switches
+	const unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(regs, 7, 0);
+	const bool avx2 = (regs[1] >> 5) & 1;
+	const bool bmi2 = (regs[1] >> 8) & 1;
+	const bool avx512 = ((regs[1] >> 16) & 1) && ((regs[1] >> 30) & 1) && ((regs[1] >> 31) & 1) && ((regs[1] >> 17) & 1);
+	if (avx512 && (xcr0 & 0xe6) == 0xe6) {
+		return CpuIsa::avx512;
+	}
+	if (avx2 && fma && bmi2 && (xcr0 & 0x6) == 0x6) {
+		return CpuIsa::avx2;
+	}
+	return sse2 ? CpuIsa::sse2 : CpuIsa::scalar;
+#elif defined(FFSTAB_NEON)
+	return CpuIsa::neon;
+#else
+	return CpuIsa::scalar;
+#endif
+}
+
+// Detected once, all dispatched kernels agree on it
+inline CpuIsa cpu_isa() {
+	static const CpuIsa isa = detect_cpu_isa();
+	return isa;
+}
+
+// Kernel version for cpu_isa(), versions that aren't compiled in (nullptr) fall back to lower ones
+template<class F>
+F select_kernel(F scalar, F avx2, F avx512) {
+	switch (cpu_isa()) {
+	case CpuIsa::avx512:
+		if (avx512) {
+			return avx512;
+		}
+		[[fallthrough]];
+	case CpuIsa::avx2:
+		if (avx2) {
+			return avx2;
+		}
+		[[fallthrough]];
+	default:
+		return scalar;
+	}
+}
+
+// Names a multi-versioned function, or nullptr when the compiler can't build per-ISA versions of generic code
+#ifdef FFSTAB_TARGET_CLONES
+#define FFSTAB_CLONE(...) __VA_ARGS__
+#else
+#define FFSTAB_CLONE(...) nullptr
+#endif
@@ -0,0 +1,398 @@
+//MIT License
+//
+//Copyright(c) 2025 Alex Kasitskyi
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files(the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions :
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <c4/video_stabilization.hpp>
+
+#include "motion_estimation.hpp"
+
+// Sparse motion: corners of the previous frame are tracked into the next one with pyramidal Lucas-Kanade,
+// and SimilarityFit is applied to the tracks. The cost grows with the number of corners rather than
+// with frame area times search area, so frames can be analyzed at a much higher resolution than with blocks.
+
+class FeatureMotionDetector {
+	// Lucas-Kanade window is (2 * windowRadius + 1) squared
+	static constexpr int windowRadius = 7;
+	static constexpr int maxIterations = 10;
+	// Corner response is summed over (2 * cornerRadius + 1) squared
+	static constexpr int cornerRadius = 2;
+	// Tracks with a bigger mean absolute difference of the windows, in gray levels, are dropped
+	static constexpr float maxTrackError = 16.f;
+
+	const int maxFeatures;
+	const int maxShift;
+	const SimilarityFit similarityFit;
+
+	typedef c4::matrix<float> Plane;
+
+	std::vector<Plane> prevPyramid;
+	std::vector<Plane> nextPyramid;
+	// Frame nextPyramid was built from. Callers keep it as their previous frame, so while its pyramid is reused it's
+	// still alive, and the address can't belong to another frame
+	const uint8_t* nextData = nullptr;
+
+	int detectedFrames = 0;
+	int detectedFeatures = 0;
+	int trackedFeatures = 0;
+
+	static void build_pyramid(const c4::VideoStabilization::Frame& frame, int levels, std::vector<Plane>& pyramid) {
+		pyramid.resize(levels);
+		pyramid[0].resize(frame.height(), frame.width());
+		for (int y = 0; y < frame.height(); y++) {
+			const uint8_t* src = frame[y];
+			float* dst = pyramid[0][y];
+			for (int x = 0; x < frame.width(); x++) {
+				dst[x] = src[x];
+			}
+		}
+
+		for (int level = 1; level < levels; level++) {
+			const Plane& src = pyramid[level - 1];
+			Plane& dst = pyramid[level];
+			dst.resize(src.height() / 2, src.width() / 2);
+			for (int y = 0; y < dst.height(); y++) {
+				const float* r0 = src[2 * y];
+				const float* r1 = src[2 * y + 1];
+				float* d = dst[y];
+				for (int x = 0; x < dst.width(); x++) {
+					d[x] = 0.25f * (r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1]);
+				}
+			}
+		}
+	}
+
+	// Enough levels for maxShift to be within the window on the coarsest level, while it's still big enough for a window
+	int pyramid_levels(int height, int width) const {
+		int levels = 1;
+		while ((windowRadius << (levels - 1)) < maxShift && std::min(height, width) >> levels >= 4 * windowRadius) {
+			levels++;
+		}
+		return levels;
+	}
+
+	// Bilinear sample with edge clamping
+	static float sample(const Plane& p, float x, float y) {
+		x = std::clamp(x, 0.f, p.width() - 1.001f);
+		y = std::clamp(y, 0.f, p.height() - 1.001f);
+		const int x0 = (int)x;
+		const int y0 = (int)y;
+		const float fx = x - x0;
+		const float fy = y - y0;
+		const float* r0 = p[y0] + x0;
+		const float* r1 = p[y0 + 1] + x0;
+		return (r0[0] * (1 - fx) + r0[1] * fx) * (1 - fy) + (r1[0] * (1 - fx) + r1[1] * fx) * fy;
+	}
+
+	// Minimum eigenvalue of the gradient structure tensor (Shi-Tomasi variant of Harris), which is what makes
+	// a window trackable by Lucas-Kanade. The strongest corner of every grid cell is taken, so corners
+	// spread over the frame, and the fit isn't dominated by a single textured area.
+	std::vector<c4::point<double>> detect_corners(const c4::VideoStabilization::Frame& image, const std::vector<c4::rectangle<int>>& ignoreRects) const {
+		const int h = image.height();
+		const int w = image.width();
+		const int border = windowRadius + 1;
+		if (h <= 2 * border || w <= 2 * border) {
+			return {};
+		}
+
+		const int cell = std::max(2 * cornerRadius + 1, (int)std::sqrt((double)(h - 2 * border) * (w - 2 * border) / maxFeatures));
+		const int rows = (h - 2 * border) / cell;
+		const int cols = (w - 2 * border) / cell;
+		const int y0 = (h - rows * cell) / 2;
+		const int x0 = (w - cols * cell) / 2;
+		const int xBegin = x0 - cornerRadius;
+		const int xEnd = x0 + cols * cell + cornerRadius;
+
+		// Column sums of gradient products over the window rows, integer so they can be updated incrementally.
+		// Gradients are doubled central differences.
+		std::vector<int> sxx(w);
+		std::vector<int> syy(w);
+		std::vector<int> sxy(w);
+		auto add_row = [&](int y, int sign) {
+			const uint8_t* r = image[y];
+			const uint8_t* up = image[y - 1];
+			const uint8_t* down = image[y + 1];
+			for (int x = xBegin; x < xEnd; x++) {
+				const int gx = r[x + 1] - r[x - 1];
+				const int gy = down[x] - up[x];
+				sxx[x] += sign * gx * gx;
+				syy[x] += sign * gy * gy;
+				sxy[x] += sign * gx * gy;
+			}
+		};
+
+		struct Corner {
+			float response = 0;
+			int x = 0;
+			int y = 0;
+		};
+		std::vector<Corner> best((size_t)rows * cols);
+		std::vector<float> response(w);
+
+		for (int dy = -cornerRadius; dy < cornerRadius; dy++) {
+			add_row(y0 + dy, 1);
+		}
+		for (int y = y0; y < y0 + rows * cell; y++) {
+			add_row(y + cornerRadius, 1);
+
+			int a = 0;
+			int b = 0;
+			int c = 0;
+			for (int x = xBegin; x < x0 + cornerRadius; x++) {
+				a += sxx[x];
+				b += syy[x];
+				c += sxy[x];
+			}
+			for (int x = x0; x < x0 + cols * cell; x++) {
+				a += sxx[x + cornerRadius];
+				b += syy[x + cornerRadius];
+				c += sxy[x + cornerRadius];
+				const float fa = float(a);
+				const float fb = float(b);
+				const float fc = float(c);
+				response[x] = 0.5f * (fa + fb) - std::sqrt(0.25f * (fa - fb) * (fa - fb) + fc * fc);
+				a -= sxx[x - cornerRadius];
+				b -= syy[x - cornerRadius];
+				c -= sxy[x - cornerRadius];
+			}
+
+			Corner* rowBest = best.data() + ((y - y0) / cell) * cols;
+			for (int col = 0; col < cols; col++) {
+				const float* cellResponse = response.data() + x0 + col * cell;
+				const int x = int(std::max_element(cellResponse, cellResponse + cell) - cellResponse);
+				if (cellResponse[x] > rowBest[col].response) {
+					rowBest[col].response = cellResponse[x];
+					rowBest[col].x = x0 + col * cell + x;
+					rowBest[col].y = y;
+				}
+			}
+
+			add_row(y - cornerRadius, -1);
+		}
+
+		// Weak corners are noise or edges, relative to the strongest one and to a gradient of a gray level per pixel
+		float strongest = 0;
+		for (const Corner& corner : best) {
+			strongest = std::max(strongest, corner.response);
+		}
+		const float area = float((2 * cornerRadius + 1) * (2 * cornerRadius + 1));
+		const float threshold = std::max(0.01f * strongest, 4 * area);
+
+		std::vector<c4::point<double>> corners;
+		for (const Corner& corner : best) {
+			if (corner.response < threshold) {
+				continue;
+			}
+			const bool ignored = std::any_of(ignoreRects.begin(), ignoreRects.end(), [&](const c4::rectangle<int>& r) {
+				return corner.x >= r.x && corner.x < r.x + r.w && corner.y >= r.y && corner.y < r.y + r.h;
+			});
+			if (!ignored) {
+				corners.emplace_back(corner.x, corner.y);
+			}
+		}
+		return corners;
+	}
+
+	// Window of side x side pixels at top left (x, y), which can be fractional. All pixels have the same
+	// fractional offset, so the bilinear weights are computed once, and only windows crossing the image edge
+	// pay for clamping.
+	static void sample_window(const Plane& p, float x, float y, int side, float* dst) {
+		const int ix = (int)std::floor(x);
+		const int iy = (int)std::floor(y);
+		if (ix >= 0 && iy >= 0 && ix + side < p.width() && iy + side < p.height()) {
+			const float fx = x - ix;
+			const float fy = y - iy;
+			const float w00 = (1 - fx) * (1 - fy);
+			const float w01 = fx * (1 - fy);
+			const float w10 = (1 - fx) * fy;
+			const float w11 = fx * fy;
+			for (int i = 0; i < side; i++) {
+				const float* r0 = p[iy + i] + ix;
+				const float* r1 = p[iy + i + 1] + ix;
+				for (int j = 0; j < side; j++) {
+					dst[i * side + j] = r0[j] * w00 + r0[j + 1] * w01 + r1[j] * w10 + r1[j + 1] * w11;
+				}
+			}
+			return;
+		}
+
+		for (int i = 0; i < side; i++) {
+			for (int j = 0; j < side; j++) {
+				dst[i * side + j] = sample(p, x + j, y + i);
+			}
+		}
+	}
+
+	// Shift of the window around p from prev to next, false if it's lost
+	bool track(const c4::point<double>& p, c4::point<double>& shift) const {
+		constexpr int side = 2 * windowRadius + 1;
+		// Prev window with a pixel of margin for gradients
+		constexpr int padded = side + 2;
+		float prevWindow[padded * padded];
+		float values[side * side];
+		float gradX[side * side];
+		float gradY[side * side];
+		float nextWindow[side * side];
+
+		float gx = 0;
+		float gy = 0;
+		const int levels = (int)prevPyramid.size();
+		for (int level = levels - 1; level >= 0; level--) {
+			const Plane& prev = prevPyramid[level];
+			const Plane& next = nextPyramid[level];
+			const float scale = 1.f / (1 << level);
+			const float px = float(p.x) * scale;
+			const float py = float(p.y) * scale;
+
+			sample_window(prev, px - windowRadius - 1, py - windowRadius - 1, padded, prevWindow);
+
+			double gxx = 0;
+			double gyy = 0;
+			double gxy = 0;
+			for (int i = 0; i < side; i++) {
+				const float* r = prevWindow + (i + 1) * padded + 1;
+				for (int j = 0; j < side; j++) {
+					const int k = i * side + j;
+					values[k] = r[j];
+					gradX[k] = 0.5f * (r[j + 1] - r[j - 1]);
+					gradY[k] = 0.5f * (r[j + padded] - r[j - padded]);
+					gxx += gradX[k] * gradX[k];
+					gyy += gradY[k] * gradY[k];
+					gxy += gradX[k] * gradY[k];
+				}
+			}
+
+			const double det = gxx * gyy - gxy * gxy;
+			if (det < 1e-3 * (gxx + gyy) * (gxx + gyy) || det <= 0) {
+				return false;
+			}
+
+			float dx = 0;
+			float dy = 0;
+			for (int iter = 0; iter < maxIterations; iter++) {
+				sample_window(next, px + gx + dx - windowRadius, py + gy + dy - windowRadius, side, nextWindow);
+
+				float bx = 0;
+				float by = 0;
+				for (int k = 0; k < side * side; k++) {
+					const float e = values[k] - nextWindow[k];
+					bx += e * gradX[k];
+					by += e * gradY[k];
+				}
+
+				const float ux = float((gyy * bx - gxy * by) / det);
+				const float uy = float((gxx * by - gxy * bx) / det);
+				dx += ux;
+				dy += uy;
+				if (ux * ux + uy * uy < 1e-4f) {
+					break;
+				}
+			}
+
+			gx += dx;
+			gy += dy;
+			if (level > 0) {
+				gx *= 2;
+				gy *= 2;
+			}
+		}
+
+		const Plane& next = nextPyramid[0];
+		const float nx = float(p.x) + gx;
+		const float ny = float(p.y) + gy;
+		if (nx < windowRadius || ny < windowRadius || nx >= next.width() - windowRadius - 1 || ny >= next.height() - windowRadius - 1) {
+			return false;
+		}
+
+		sample_window(next, nx - windowRadius, ny - windowRadius, side, nextWindow);
+		float error = 0;
+		for (int k = 0; k < side * side; k++) {
+			error += std::abs(values[k] - nextWindow[k]);
+		}
+		if (error > maxTrackError * side * side) {
+			return false;
+		}
+
+		shift = c4::point<double>(gx, gy);
+		return true;
+	}
+
+public:
+	FeatureMotionDetector(const c4::VideoStabilization::Params& params, int maxFeatures, FitMethod fitMethod)
+		: maxFeatures(maxFeatures), maxShift(params.maxShift), similarityFit(params.maxAlpha, params.maxScale, fitMethod) {
+		ASSERT_GREATER(maxFeatures, 0);
+	}
+
+	c4::MotionDetector::Motion detect(const c4::VideoStabilization::Frame& prev, const c4::VideoStabilization::Frame& next, const std::vector<c4::rectangle<int>>& ignoreRects) {
+		STATIC_SCOPED_TIMER("FeatureMotionDetector::detect()");
+
+		ASSERT_EQUAL(prev.width(), next.width());
+		ASSERT_EQUAL(prev.height(), next.height());
+
+		// Consecutive frames share a pyramid: the next frame of the last call is the previous one of this call
+		const int levels = pyramid_levels(prev.height(), prev.width());
+		if (prev.data() == nextData && (int)nextPyramid.size() == levels && nextPyramid[0].height() == prev.height() && nextPyramid[0].width() == prev.width()) {
+			std::swap(prevPyramid, nextPyramid);
+		} else {
+			build_pyramid(prev, levels, prevPyramid);
+		}
+		build_pyramid(next, levels, nextPyramid);
+		nextData = next.data();
+
+		const std::vector<c4::point<double>> corners = detect_corners(prev, ignoreRects);
+
+		std::vector<BlockMatch> matches;
+		for (const c4::point<double>& corner : corners) {
+			BlockMatch match;
+			if (track(corner, match.shift)) {
+				match.pos = corner;
+				match.weight = 1.;
+				matches.push_back(match);
+			}
+		}
+
+		detectedFrames++;
+		detectedFeatures += (int)corners.size();
+		trackedFeatures += (int)matches.size();
+
+		if (matches.empty()) {
+			return c4::MotionDetector::Motion();
+		}
+
+		// Lost corners count as outliers
+		c4::MotionDetector::Motion motion = similarityFit(matches, c4::point<double>(prev.width() / 2., prev.height() / 2.));
+		motion.confidence *= double(matches.size()) / corners.size();
+		return motion;
+	}
+
+	double tracked_share() const {
+		return detectedFeatures ? double(trackedFeatures) / detectedFeatures : 0.;
+	}
+
+	double average_features() const {
+		return detectedFrames ? double(detectedFeatures) / detectedFrames : 0.;
+	}
+};
@@ -20,7 +20,11 @@
 //OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 //SOFTWARE.
 
+#include <cmath>
+#include <numbers>
 #include <memory>
+#include <thread>
+#include <fstream>
 
 #include <c4/drawing.hpp>
 #include <c4/cmd_opts.hpp>
@@ -28,10 +32,19 @@
 #include <c4/video_stabilization.hpp>
 #include <c4/progress_indicator.hpp>
 
+#include "cpu_dispatch.hpp"
+#include "motion_estimation.hpp"
+#include "phase_correlation.hpp"
+#include "feature_tracking.hpp"
+#include "gyro_motion.hpp"
+#include "warp.hpp"
+
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/motion_vector.h>
 #include <libswscale/swscale.h>
 }
 
@@ -60,13 +73,27 @@ class FfmpegVideoProcessor {
 	int videoStreamIndex = -1;
 	std::vector<int> streamMapping;
 	int frameNumber = 0;
+	const bool exportMotionVectors;
+
+	// Zero for the input size
+	const c4::matrix_dimensions outputSize;
+	// AV_PIX_FMT_NONE for the input format
+	const AVPixelFormat outputPixFmt;
+	// Fast low quality render: video only, outputSize defaults to a fraction of the input, fastest encoder preset
+	const bool preview;
+	static constexpr int previewDownscale = 4;
+	// Decode without the deblocking filter, only when motion isn't detected on the decoded frames
+	const bool skipDeblocking;
+	// Frame the processor writes into when the output size or format differs from the input one
+	AVFrame* outputFrame = nullptr;
 
 public:
 
 	class FrameProcessor {
 	public:
 		virtual void preprocess(AVFrame* src) = 0;
-		virtual void process(AVFrame* src) = 0;
+		// Stabilizes src into dst, which is src itself unless the output has a different size
+		virtual void process(AVFrame* src, AVFrame* dst) = 0;
 		virtual ~FrameProcessor() = default;
 	};
 
@@ -94,6 +121,9 @@ public:
 				LOGW << "Skipping stream " << i << " of type " << av_get_media_type_string(inCodecParameters->codec_type);
 				continue;
 			}
+			if (preview && inCodecParameters->codec_type != AVMEDIA_TYPE_VIDEO) {
+				continue;
+			}
 
 			streamMapping[i] = outStreamIndex++;
 
@@ -120,6 +150,13 @@ public:
 		inputCodecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 		inputCodecContext->thread_count = std::thread::hardware_concurrency();
 		PRINT_DEBUG(inputCodecContext->thread_count);
+		if (exportMotionVectors) {
+			inputCodecContext->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+		}
+		if (skipDeblocking) {
+			// Deblocking is a large share of decoding, and its artifacts are hardly visible at the preview size
+			inputCodecContext->skip_loop_filter = AVDISCARD_ALL;
+		}
 
 		ASSERT_TRUE(inputCodecContext != nullptr);
 		ASSERT_TRUE(avcodec_parameters_to_context(inputCodecContext, inputVideoCodecParameters) >= 0);
@@ -151,10 +188,46 @@ public:
 		outputCodecContext = avcodec_alloc_context3(outputVideoCodec);
 		ASSERT_TRUE(outputCodecContext != nullptr);
 
-		outputCodecContext->height = inputCodecContext->height;
-		outputCodecContext->width = inputCodecContext->width;
+		outputCodecContext->height = outputSize.height ? outputSize.height : inputCodecContext->height;
+		outputCodecContext->width = outputSize.width ? outputSize.width : inputCodecContext->width;
 		outputCodecContext->sample_aspect_ratio = inputCodecContext->sample_aspect_ratio;
-		outputCodecContext->pix_fmt = inputCodecContext->pix_fmt;
+		outputCodecContext->pix_fmt = outputPixFmt != AV_PIX_FMT_NONE ? outputPixFmt : inputCodecContext->pix_fmt;
+
+		const AVPixFmtDescriptor* pixdesc = av_pix_fmt_desc_get(outputCodecContext->pix_fmt);
+		if (preview && !outputSize.height) {
+			const int alignH = 1 << pixdesc->log2_chroma_h;
+			const int alignW = 1 << pixdesc->log2_chroma_w;
+			outputCodecContext->height = std::max(inputCodecContext->height / previewDownscale / alignH * alignH, alignH);
+			outputCodecContext->width = std::max(inputCodecContext->width / previewDownscale / alignW * alignW, alignW);
+		}
+		const bool convert = outputCodecContext->pix_fmt != inputCodecContext->pix_fmt;
+		if (convert) {
+			// The warp converts bit depth, chroma subsampling and layout, but not the color model
+			const AVPixFmtDescriptor* inputPixdesc = av_pix_fmt_desc_get(inputCodecContext->pix_fmt);
+			if ((inputPixdesc->flags & AV_PIX_FMT_FLAG_RGB) != (pixdesc->flags & AV_PIX_FMT_FLAG_RGB) || (inputPixdesc->nb_components > 2) != (pixdesc->nb_components > 2)) {
+				THROW_EXCEPTION(std::string("Can't convert ") + inputPixdesc->name + " to " + pixdesc->name + ", output_pix_fmt should have the color model of the input");
+			}
+		}
+
+		const bool resize = outputCodecContext->height != inputCodecContext->height || outputCodecContext->width != inputCodecContext->width;
+		if (resize) {
+			if (outputCodecContext->width % (1 << pixdesc->log2_chroma_w) || outputCodecContext->height % (1 << pixdesc->log2_chroma_h)) {
+				THROW_EXCEPTION(std::string("Output size doesn't fit the chroma subsampling of ") + pixdesc->name);
+			}
+
+			// Display aspect ratio stays the same
+			AVRational sar = inputCodecContext->sample_aspect_ratio.num ? inputCodecContext->sample_aspect_ratio : AVRational{ 1, 1 };
+			av_reduce(&sar.num, &sar.den, (int64_t)sar.num * inputCodecContext->width * outputCodecContext->height, (int64_t)sar.den * inputCodecContext->height * outputCodecContext->width, INT_MAX);
+			outputCodecContext->sample_aspect_ratio = sar;
+		}
+		if (resize || convert) {
+			outputFrame = av_frame_alloc();
+			ASSERT_TRUE(outputFrame != nullptr);
+			outputFrame->format = outputCodecContext->pix_fmt;
+			outputFrame->width = outputCodecContext->width;
+			outputFrame->height = outputCodecContext->height;
+			AV_CALL(av_frame_get_buffer(outputFrame, 0));
+		}
 		outputCodecContext->bit_rate = output_bitrate ? output_bitrate : inputCodecContext->bit_rate;
 		outputCodecContext->time_base = av_inv_q(input_framerate);
 
@@ -162,8 +235,19 @@ public:
 		outputCodecContext->thread_count = std::thread::hardware_concurrency() / 2;
 		PRINT_DEBUG(outputCodecContext->thread_count);
 
-		AV_CALL(avcodec_open2(outputCodecContext, outputVideoCodec, NULL));
-		AV_CALL(avcodec_parameters_from_context(outputFormatContext->streams[videoStreamIndex]->codecpar, outputCodecContext));
+		AVDictionary* codecOptions = nullptr;
+		if (preview) {
+			const std::string codecName = outputVideoCodec->name;
+			if (codecName == "libx264" || codecName == "libx265") {
+				av_dict_set(&codecOptions, "preset", "ultrafast", 0);
+			} else if (codecName.ends_with("_nvenc")) {
+				av_dict_set(&codecOptions, "preset", "p1", 0);
+			}
+		}
+		const int openResult = avcodec_open2(outputCodecContext, outputVideoCodec, &codecOptions);
+		av_dict_free(&codecOptions);
+		AV_CALL(openResult);
+		AV_CALL(avcodec_parameters_from_context(outputFormatContext->streams[streamMapping[videoStreamIndex]]->codecpar, outputCodecContext));
 
 		if (outputFormatContext->oformat->flags & AVFMT_GLOBALHEADER){
 			outputFormatContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
@@ -174,8 +258,8 @@ public:
 		AV_CALL(avformat_write_header(outputFormatContext, NULL));
 	}
 
-	FfmpegVideoProcessor(const std::string& input_filename, const std::string& output_filename, const int64_t output_bitrate, const std::string output_codec)
-		: input_filename(input_filename), output_filename(output_filename), output_bitrate(output_bitrate), output_codec(output_codec) {
+	FfmpegVideoProcessor(const std::string& input_filename, const std::string& output_filename, const int64_t output_bitrate, const std::string output_codec, bool exportMotionVectors = false, const c4::matrix_dimensions& outputSize = {}, AVPixelFormat outputPixFmt = AV_PIX_FMT_NONE, bool preview = false, bool skipDeblocking = false)
+		: input_filename(input_filename), output_filename(output_filename), output_bitrate(output_bitrate), output_codec(output_codec), exportMotionVectors(exportMotionVectors), outputSize(outputSize), outputPixFmt(outputPixFmt), preview(preview), skipDeblocking(skipDeblocking) {
 		init_input();
 		init_output();
 	}
@@ -204,18 +288,25 @@ public:
 
 				AVFrame* frame = av_frame_alloc();
 				while(avcodec_receive_frame(inputCodecContext, frame) >= 0) {
+					frame->time_base = inStream->time_base;
 					if (preprocess) {
 						frame_processor.preprocess(frame);
 					} else {
-						frame_processor.process(frame);
-						frame->pict_type = AV_PICTURE_TYPE_NONE;
-						encode_frame(inStream, outputFormatContext->streams[packet.stream_index], frame);
+						AVFrame* out = frame;
+						if (outputFrame) {
+							AV_CALL(av_frame_make_writable(outputFrame));
+							AV_CALL(av_frame_copy_props(outputFrame, frame));
+							out = outputFrame;
+						}
+						frame_processor.process(frame, out);
+						out->pict_type = AV_PICTURE_TYPE_NONE;
+						encode_frame(inStream, outputFormatContext->streams[streamMapping[packet.stream_index]], out);
 					}
 					progress.did_some(1);
 				}
 				av_frame_unref(frame);
 			} else if (!preprocess) {
-				AVStream* outStream = outputFormatContext->streams[packet.stream_index];
+				AVStream* outStream = outputFormatContext->streams[streamMapping[packet.stream_index]];
 				packet.pts = av_rescale_q_rnd(packet.pts, inStream->time_base, outStream->time_base, AVRounding(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
 				packet.dts = av_rescale_q_rnd(packet.dts, inStream->time_base, outStream->time_base, AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
 				packet.duration = av_rescale_q(packet.duration, inStream->time_base, outStream->time_base);
@@ -229,10 +320,11 @@ public:
 		progress.print_final();
 
 		if (!preprocess) {
-			encode_frame(inputFormatContext->streams[videoStreamIndex], outputFormatContext->streams[videoStreamIndex], nullptr);
+			encode_frame(inputFormatContext->streams[videoStreamIndex], outputFormatContext->streams[streamMapping[videoStreamIndex]], nullptr);
 			av_write_trailer(outputFormatContext);
 			avio_closep(&outputFormatContext->pb);
 			avformat_free_context(outputFormatContext);
+			av_frame_free(&outputFrame);
 		}
 
 		avformat_close_input(&inputFormatContext);
@@ -243,7 +335,7 @@ public:
 
 		AVPacket *output_packet = av_packet_alloc();
 		while (avcodec_receive_packet(outputCodecContext, output_packet) >= 0) {
-			output_packet->stream_index = videoStreamIndex;
+			output_packet->stream_index = outStream->index;
 			av_packet_rescale_ts(output_packet, inStream->time_base, outStream->time_base);
 			ASSERT_TRUE(av_interleaved_write_frame(outputFormatContext, output_packet) >= 0);
 		}
@@ -252,38 +344,623 @@ public:
 	}
 };
 
+// Uncompressed dump of the downscaled gray frames used for motion detection.
+// Every frame has the same size, so the file can be memory-mapped or seeked into directly.
+// Re-running the analysis from it needs no decoding or scaling at all.
+struct AnalysisProxyHeader {
+	char magic[8] = { 'F', 'F', 'S', 'P', 'R', 'O', 'X', '1' };
+	int32_t width = 0;
+	int32_t height = 0;
+	int32_t downscale = 0;
+	int32_t sourceWidth = 0;
+	int32_t sourceHeight = 0;
+	int32_t reserved = 0;
+
+	bool valid() const {
+		return std::equal(magic, magic + sizeof(magic), AnalysisProxyHeader().magic) && width > 0 && height > 0 && downscale > 0;
+	}
+};
+
+class AnalysisProxyWriter {
+	std::ofstream file;
+	AnalysisProxyHeader header;
+
+public:
+	AnalysisProxyWriter(const std::string& filename, int width, int height, int downscale, int sourceWidth, int sourceHeight)
+		: file(filename, std::ios::binary) {
+		if (!file) {
+			THROW_EXCEPTION("Can't open analysis proxy for writing: " + filename);
+		}
+		header.width = width;
+		header.height = height;
+		header.downscale = downscale;
+		header.sourceWidth = sourceWidth;
+		header.sourceHeight = sourceHeight;
+		file.write((const char*)&header, sizeof(header));
+	}
+
+	void write(const c4::VideoStabilization::Frame& frame) {
+		ASSERT_EQUAL(frame.width(), header.width);
+		ASSERT_EQUAL(frame.height(), header.height);
+		for (int i : c4::range(frame.height())) {
+			file.write((const char*)(frame.data() + i * frame.stride()), frame.width());
+		}
+		if (!file) {
+			THROW_EXCEPTION("Failed writing analysis proxy");
+		}
+	}
+};
+
+class AnalysisProxyReader {
+	std::ifstream file;
+	AnalysisProxyHeader header;
+	int64_t frameCount = 0;
+
+public:
+	AnalysisProxyReader(const std::string& filename) : file(filename, std::ios::binary) {
+		if (!file) {
+			THROW_EXCEPTION("Can't open analysis proxy: " + filename);
+		}
+		file.read((char*)&header, sizeof(header));
+		if (!file || !header.valid()) {
+			THROW_EXCEPTION("Invalid analysis proxy: " + filename);
+		}
+
+		file.seekg(0, std::ios::end);
+		const int64_t dataSize = (int64_t)file.tellg() - (int64_t)sizeof(header);
+		const int64_t frameSize = (int64_t)header.width * header.height;
+		if (dataSize % frameSize) {
+			THROW_EXCEPTION("Analysis proxy is truncated: " + filename);
+		}
+		frameCount = dataSize / frameSize;
+		file.seekg(sizeof(header), std::ios::beg);
+
+		PRINT_DEBUG(header.width);
+		PRINT_DEBUG(header.height);
+		PRINT_DEBUG(header.downscale);
+		PRINT_DEBUG(frameCount);
+	}
+
+	int width() const {
+		return header.width;
+	}
+
+	int height() const {
+		return header.height;
+	}
+
+	int downscale() const {
+		return header.downscale;
+	}
+
+	c4::matrix_dimensions source_size() const {
+		c4::matrix_dimensions ret{ .height = header.sourceHeight, .width = header.sourceWidth };
+		return ret;
+	}
+
+	int64_t size() const {
+		return frameCount;
+	}
+
+	c4::VideoStabilization::FramePtr read() {
+		c4::VideoStabilization::FramePtr frame = std::make_shared<c4::VideoStabilization::Frame>();
+		frame->resize(header.height, header.width);
+		for (int i : c4::range(frame->height())) {
+			file.read((char*)(frame->data() + i * frame->stride()), frame->width());
+		}
+		if (!file) {
+			return nullptr;
+		}
+		return frame;
+	}
+};
+
+// Sequential decoder for the video stream of a file, all other streams are ignored.
+class FfmpegVideoReader {
+	AVFormatContext* formatContext = nullptr;
+	AVCodecContext* codecContext = nullptr;
+	AVPacket* packet = nullptr;
+	int videoStreamIndex = -1;
+	bool flushed = false;
+
+public:
+	FfmpegVideoReader(const std::string& filename, bool exportMotionVectors = false) {
+		AV_CALL(avformat_open_input(&formatContext, filename.c_str(), NULL, NULL));
+		AV_CALL(avformat_find_stream_info(formatContext, NULL));
+
+		const AVCodec* codec = NULL;
+		videoStreamIndex = AV_CALL(av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0));
+		ASSERT_TRUE(codec != nullptr);
+
+		codecContext = avcodec_alloc_context3(codec);
+		ASSERT_TRUE(codecContext != nullptr);
+		codecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+		codecContext->thread_count = std::thread::hardware_concurrency();
+		if (exportMotionVectors) {
+			codecContext->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+		}
+		AV_CALL(avcodec_parameters_to_context(codecContext, formatContext->streams[videoStreamIndex]->codecpar));
+		AV_CALL(avcodec_open2(codecContext, codec, NULL));
+
+		packet = av_packet_alloc();
+		ASSERT_TRUE(packet != nullptr);
+
+		PRINT_DEBUG(codec->name);
+		PRINT_DEBUG(codecContext->width);
+		PRINT_DEBUG(codecContext->height);
+	}
+
+	FfmpegVideoReader(const FfmpegVideoReader&) = delete;
+	FfmpegVideoReader& operator=(const FfmpegVideoReader&) = delete;
+
+	c4::matrix_dimensions get_frame_size() const {
+		c4::matrix_dimensions ret{ .height = codecContext->height, .width = codecContext->width };
+		return ret;
+	}
+
+	int64_t frame_count() const {
+		return formatContext->streams[videoStreamIndex]->nb_frames;
+	}
+
+	// Returns false after the last frame
+	bool read(AVFrame* frame) {
+		for (;;) {
+			const int ret = avcodec_receive_frame(codecContext, frame);
+			if (ret >= 0) {
+				frame->time_base = formatContext->streams[videoStreamIndex]->time_base;
+				return true;
+			}
+			if (ret == AVERROR_EOF) {
+				return false;
+			}
+			if (ret != AVERROR(EAGAIN)) {
+				AV_CALL(ret);
+			}
+
+			if (flushed) {
+				return false;
+			}
+
+			if (av_read_frame(formatContext, packet) < 0) {
+				AV_CALL(avcodec_send_packet(codecContext, nullptr));
+				flushed = true;
+				continue;
+			}
+
+			if (packet->stream_index == videoStreamIndex) {
+				AV_CALL(avcodec_send_packet(codecContext, packet));
+			}
+			av_packet_unref(packet);
+		}
+	}
+
+	~FfmpegVideoReader() {
+		av_packet_free(&packet);
+		avcodec_free_context(&codecContext);
+		avformat_close_input(&formatContext);
+	}
+};
+
+// Gyroscope track of a file, read from its GoPro metadata (GPMF) stream. Empty if the file has none.
+static std::unique_ptr<GyroMotion> read_gyro(const std::string& filename, const std::string& axes) {
+	AVFormatContext* formatContext = nullptr;
+	AV_CALL(avformat_open_input(&formatContext, filename.c_str(), NULL, NULL));
+	AV_CALL(avformat_find_stream_info(formatContext, NULL));
+
+	int streamIndex = -1;
+	for (unsigned i = 0; i < formatContext->nb_streams; i++) {
+		if (formatContext->streams[i]->codecpar->codec_tag == MKTAG('g', 'p', 'm', 'd')) {
+			streamIndex = i;
+			break;
+		}
+	}
+
+	std::unique_ptr<GyroMotion> gyro = std::make_unique<GyroMotion>(axes);
+	if (streamIndex >= 0) {
+		const AVStream* stream = formatContext->streams[streamIndex];
+		AVPacket* packet = av_packet_alloc();
+		ASSERT_TRUE(packet != nullptr);
+		while (av_read_frame(formatContext, packet) >= 0) {
+			if (packet->stream_index == streamIndex && packet->pts != AV_NOPTS_VALUE) {
+				gyro->add_payload(packet->data, packet->size, packet->pts * av_q2d(stream->time_base), packet->duration * av_q2d(stream->time_base));
+			}
+			av_packet_unref(packet);
+		}
+		av_packet_free(&packet);
+	}
+
+	avformat_close_input(&formatContext);
+	return gyro;
+}
+
+// Global motion fitted to the motion vectors the decoder exports with AV_CODEC_FLAG2_EXPORT_MVS.
+// Decoders only tell whether a vector points to the past or the future, not to which frame, so past vectors
+// are taken relative to the last I or P frame in display order (the anchor). That's exact for streams without
+// B-pyramids. Motion from the anchor is turned into frame to frame motion by removing the motion from the
+// anchor to the previous frame.
+class CodecMotionEstimator {
+	const SimilarityFit similarityFit;
+	std::vector<BlockMatch> matches;
+	c4::MotionDetector::Motion prevFromAnchor;
+
+	static bool is_anchor(const AVFrame* frame) {
+		return frame->pict_type == AV_PICTURE_TYPE_I || frame->pict_type == AV_PICTURE_TYPE_P;
+	}
+
+	static bool ignored(const std::vector<c4::rectangle<int>>& ignoreRects, double x, double y) {
+		return std::any_of(ignoreRects.begin(), ignoreRects.end(), [&](const c4::rectangle<int>& r) { return x >= r.x && x < r.x + r.w && y >= r.y && y < r.y + r.h; });
+	}
+
+public:
+	CodecMotionEstimator(const c4::VideoStabilization::Params& params, FitMethod fitMethod) : similarityFit(params.maxAlpha, params.maxScale, fitMethod) {}
+
+	// Frame to frame motion in pixels of a workWidth x workHeight frame. Returns false if the frame has no past vectors,
+	// e.g. an I frame or a codec that can't export them. Then the motion should be found otherwise and passed to update().
+	bool estimate(const AVFrame* frame, int workWidth, int workHeight, const std::vector<c4::rectangle<int>>& ignoreRects, c4::MotionDetector::Motion& motion) {
+		const AVFrameSideData* sideData = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+		if (sideData == nullptr || frame->pict_type == AV_PICTURE_TYPE_I) {
+			return false;
+		}
+
+		const double kx = double(workWidth) / frame->width;
+		const double ky = double(workHeight) / frame->height;
+
+		const AVMotionVector* mvs = (const AVMotionVector*)sideData->data;
+		const size_t count = sideData->size / sizeof(AVMotionVector);
+
+		matches.clear();
+		double area = 0;
+		for (size_t i = 0; i < count; i++) {
+			const AVMotionVector& mv = mvs[i];
+			if (mv.source >= 0 || mv.motion_scale == 0) {
+				continue;
+			}
+
+			if (ignored(ignoreRects, mv.dst_x * kx, mv.dst_y * ky)) {
+				continue;
+			}
+
+			// The block at dst is predicted from dst + motion in the reference frame
+			const double mx = double(mv.motion_x) / mv.motion_scale;
+			const double my = double(mv.motion_y) / mv.motion_scale;
+
+			BlockMatch match;
+			match.pos = c4::point<double>((mv.dst_x + mx) * kx, (mv.dst_y + my) * ky);
+			match.shift = c4::point<double>(-mx * kx, -my * ky);
+			match.weight = 1;
+			matches.push_back(match);
+			area += mv.w * mv.h;
+		}
+
+		if (matches.empty()) {
+			return false;
+		}
+
+		c4::MotionDetector::Motion fromAnchor = similarityFit(matches, c4::point<double>(workWidth / 2., workHeight / 2.));
+		// Intra coded blocks have no vectors, a frame that is mostly intra coded is likely a scene cut
+		fromAnchor.confidence *= std::min(1., area / (double(frame->width) * frame->height));
+
+		motion = motion_difference(fromAnchor, prevFromAnchor);
+		prevFromAnchor = is_anchor(frame) ? c4::MotionDetector::Motion() : fromAnchor;
+
+		return true;
+	}
+
+	// Motion of a frame estimate() had no vectors for
+	void update(const AVFrame* frame, const c4::MotionDetector::Motion& motion) {
+		prevFromAnchor = is_anchor(frame) ? c4::MotionDetector::Motion() : compose_motion(motion, prevFromAnchor);
+	}
+};
+
+// Formats process() can warp: 8 to 16 bit integer components of whole bytes, planar or interleaved
+static bool warpable_format(const AVPixFmtDescriptor* pixdesc) {
+	if (pixdesc == nullptr || (pixdesc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_FLOAT | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM))) {
+		return false;
+	}
+	for (int c = 0; c < pixdesc->nb_components; c++) {
+		const AVComponentDescriptor& comp = pixdesc->comp[c];
+		const int bytes = comp.depth > 8 ? 2 : 1;
+		if (comp.depth < 8 || comp.depth + comp.shift > 8 * bytes || comp.step % bytes || comp.offset % bytes) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// 64 bit hash of the pixels of a frame, row padding isn't hashed. Four lanes of xxHash64 rounds over 8 byte words.
+// Only the first planes are hashed, and of them only every rowStep-th row.
+static uint64_t frame_hash(const AVFrame* frame, int planes = 4, int rowStep = 1) {
+	constexpr uint64_t prime1 = 0x9e3779b185ebca87ull;
+	constexpr uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+	auto round = [](uint64_t acc, uint64_t word) {
+		return std::rotl(acc + word * prime2, 31) * prime1;
+	};
+
+	const AVPixelFormat format = (AVPixelFormat)frame->format;
+	const AVPixFmtDescriptor* pixdesc = av_pix_fmt_desc_get(format);
+	int rowBytes[4] = {};
+	AV_CALL(av_image_fill_linesizes(rowBytes, format, frame->width));
+
+	uint64_t lanes[4] = { prime1, prime2, 0, ~prime1 };
+	for (int p = 0; p < std::min(planes, av_pix_fmt_count_planes(format)); p++) {
+		const int h = p == 1 || p == 2 ? AV_CEIL_RSHIFT(frame->height, pixdesc->log2_chroma_h) : frame->height;
+		for (int i = 0; i < h; i += rowStep) {
+			const uint8_t* row = frame->data[p] + (size_t)i * frame->linesize[p];
+			int j = 0;
+			for (; j + 32 <= rowBytes[p]; j += 32) {
+				for (int k = 0; k < 4; k++) {
+					uint64_t word;
+					std::memcpy(&word, row + j + 8 * k, 8);
+					lanes[k] = round(lanes[k], word);
+				}
+			}
+			for (; j < rowBytes[p]; j++) {
+				lanes[0] = round(lanes[0], row[j]);
+			}
+		}
+	}
+
+	uint64_t hash = std::rotl(lanes[0], 1) + std::rotl(lanes[1], 7) + std::rotl(lanes[2], 12) + std::rotl(lanes[3], 18);
+	hash ^= hash >> 33;
+	hash *= prime2;
+	hash ^= hash >> 29;
+	return hash;
+}
+
+// Chroma components are subsampled, alpha isn't
+static int component_height(const AVFrame* frame, const AVPixFmtDescriptor* pixdesc, int c) {
+	return c == 1 || c == 2 ? AV_CEIL_RSHIFT(frame->height, pixdesc->log2_chroma_h) : frame->height;
+}
+
+static int component_width(const AVFrame* frame, const AVPixFmtDescriptor* pixdesc, int c) {
+	return c == 1 || c == 2 ? AV_CEIL_RSHIFT(frame->width, pixdesc->log2_chroma_w) : frame->width;
+}
+
+template<class T>
+bool component_is_plane(const AVComponentDescriptor& comp) {
+	return comp.step == sizeof(T) && comp.shift == 0;
+}
+
+template<class T>
+void apply_motion(const c4::MotionDetector::Motion& motion, const std::vector<c4::matrix_ref<T>>& src, std::vector<c4::matrix_ref<T>>& dst, WarpInterpolation interpolation) {
+	const WarpTransform transform = warp_transform(motion, src[0], dst[0]);
+	const WarpKernels kernels = warp_kernels<T>(transform, interpolation);
+	if (transform == WarpTransform::translation) {
+		warp_shift_planes(motion, src, dst, kernels);
+	} else {
+		warp_planes(motion, src, dst, kernels);
+	}
+}
+
+// Warp that also converts the sample depth, see SampleConversion
+template<class T, class U>
+void apply_motion(const c4::MotionDetector::Motion& motion, const std::vector<c4::matrix_ref<T>>& src, std::vector<c4::matrix_ref<U>>& dst, WarpInterpolation interpolation, const SampleConversion& conversion) {
+	if constexpr (std::is_same_v<T, U>) {
+		if (conversion.srcDepth == conversion.dstDepth) {
+			apply_motion(motion, src, dst, interpolation);
+			return;
+		}
+	}
+	const WarpTransform transform = warp_transform(motion, src[0], dst[0]);
+	warp_planes(motion, src, dst, warp_kernels<T>(transform, interpolation), conversion);
+}
+
+// c4's motion detection compiled for every ISA. c4 is header only, and flatten inlines process() and the block matching
+// it calls directly into each version, so the default detector is auto-vectorized for the instruction set of the clone.
+// c4's own intrinsics are selected by macros like __AVX2__, which stay undefined here, only FFSTABILIZE_NATIVE enables them.
+typedef c4::MotionDetector::Motion (*StabilizeFunction)(c4::VideoStabilization& stabilizer, c4::VideoStabilization::FramePtr frame, const std::vector<c4::rectangle<int>>& ignoreRects);
+
+inline c4::MotionDetector::Motion stabilize_scalar(c4::VideoStabilization& stabilizer, c4::VideoStabilization::FramePtr frame, const std::vector<c4::rectangle<int>>& ignoreRects) {
+	return stabilizer.process(frame, ignoreRects);
+}
+
+#ifdef FFSTAB_TARGET_CLONES
+FFSTAB_FLATTEN FFSTAB_TARGET_AVX2 inline c4::MotionDetector::Motion stabilize_avx2(c4::VideoStabilization& stabilizer, c4::VideoStabilization::FramePtr frame, const std::vector<c4::rectangle<int>>& ignoreRects) {
+	return stabilizer.process(frame, ignoreRects);
+}
+
+FFSTAB_FLATTEN FFSTAB_TARGET_AVX512 inline c4::MotionDetector::Motion stabilize_avx512(c4::VideoStabilization& stabilizer, c4::VideoStabilization::FramePtr frame, const std::vector<c4::rectangle<int>>& ignoreRects) {
+	return stabilizer.process(frame, ignoreRects);
+}
+#endif
+
+inline c4::MotionDetector::Motion stabilize(c4::VideoStabilization& stabilizer, c4::VideoStabilization::FramePtr frame, const std::vector<c4::rectangle<int>>& ignoreRects) {
+	static const StabilizeFunction kernel = select_kernel<StabilizeFunction>(stabilize_scalar, FFSTAB_CLONE(stabilize_avx2), FFSTAB_CLONE(stabilize_avx512));
+	return kernel(stabilizer, frame, ignoreRects);
+}
+
+struct AnalysisParams {
+	// "c4" uses c4::VideoStabilization, "blocks" uses BlockMotionDetector and MotionSmoother,
+	// "phasecorr" uses PhaseCorrelationDetector and "features" uses FeatureMotionDetector, both with MotionSmoother
+	std::string detector = "c4";
+	// phasecorr also estimates rotation and scale
+	bool logPolar = false;
+	// Corners tracked by the features detector
+	int maxFeatures = 300;
+	// Coarse analysis downscale relative to the work frame, 0 disables adaptive analysis
+	int adaptiveFactor = 0;
+	// Frames with lower confidence at the coarse downscale are analyzed again on the work frame
+	double refineThreshold = 0.3;
+	// Scene cut threshold of the blocks, phasecorr and features detectors. Their confidence is on a scale of its own,
+	// the share of matches that agree with the motion weighted by how distinct each match is, so c4's
+	// scene_cut_threshold doesn't apply to them.
+	double sceneCutThreshold = 0.1;
+	// "pixels" matches blocks of the analysis frames, "codec_mv" fits the motion to the decoder's motion vectors,
+	// "hybrid" refines that motion with a refine_radius block search, "gyro" integrates the gyroscope track of the input
+	std::string motionSource = "pixels";
+	// Horizontal field of view of the camera in radians, maps gyro rotation to pixels
+	double gyroFov = 118 * std::numbers::pi / 180;
+	// Seconds to add to frame timestamps to get gyro timestamps
+	double gyroOffset = 0;
+	// Correct gyro motion by the detector's motion, weighted by its confidence
+	bool gyroFusion = false;
+	BlockMatchingParams blockMatching;
+};
+
 class VidStabProcessor : public FfmpegVideoProcessor::FrameProcessor {
 	c4::VideoStabilization stabilizer;
+	const AnalysisParams analysisParams;
+	BlockMotionDetector blockDetector;
+	PhaseCorrelationDetector phaseDetector;
+	FeatureMotionDetector featureDetector;
+	CodecMotionEstimator codecMotion;
+	MotionSmoother smoother;
 	const int frameWidth;
 	const int frameHeight;
+	const c4::matrix_dimensions analysisSize;
 	const int downscale;
 	const int workWidth;
 	const int workHeight;
 	const std::vector<c4::rectangle<int>> ignoreRects;
+	const std::vector<c4::rectangle<int>> scaledIgnoreRects;
+	const std::vector<c4::rectangle<int>> coarseIgnoreRects;
 	const double prezoom;
 	const bool autozoom;
 	const double zoomSpeed;
 	const bool debugImprint;
+	// Ordered dither when the output has fewer bits per sample than the input
+	const bool dither;
+	// Frames no pixel of which moves farther than this are output as they are, 0 warps every frame
+	const double passthroughThreshold;
+	// Nearest samples the source at the output resolution without prefiltering, for previews
+	const WarpInterpolation interpolation;
 
 	int frameCounter = 0;
+	int processedFrames = 0;
+	int passthroughFrames = 0;
 	SwsContext* sws_downscale_ctx = nullptr;
 	std::deque<c4::MotionDetector::Motion> preprocessed;
 	std::deque<double> prepZoom;
-
-	static std::vector<c4::rectangle<int>> downscale_rects(const std::vector<c4::rectangle<int>>& rects, int downscale) {
+	int analyzedFrames = 0;
+	c4::VideoStabilization::FramePtr prevFrame;
+	c4::VideoStabilization::FramePtr prevCoarseFrame;
+	int codecMotionFrames = 0;
+	double prevCodecTime = NAN;
+	std::unique_ptr<GyroMotion> gyro;
+	double prevGyroTime = NAN;
+	int gyroMotionFrames = 0;
+	int duplicateFrames = 0;
+
+	// Work frame of the previous source frame, reused by its duplicates, see analyze(AVFrame*)
+	static constexpr int duplicateRowStep = 4;
+	uint64_t prevSourceHash = 0;
+	c4::VideoStabilization::FramePtr prevWorkFrame;
+
+	// Last warped output and what it was warped from, frames with the same source and motion reuse it.
+	// The hash is only taken when the motion is the same as that of the previous frame, reuseHash says whether it's set.
+	bool reuseHash = false;
+	uint64_t prevHash = 0;
+	c4::MotionDetector::Motion prevMotion;
+	AVFrame* prevOutput = nullptr;
+	int reusedFrames = 0;
+	std::unique_ptr<AnalysisProxyReader> proxyReader;
+	std::unique_ptr<AnalysisProxyWriter> proxyWriter;
+
+	std::unique_ptr<FfmpegVideoReader> analysisReader;
+	AVFrame* analysisFrame = nullptr;
+	AVFrame* nextAnalysisFrame = nullptr;
+	bool hasNextAnalysisFrame = false;
+	double sourceStartTime = NAN;
+	double analysisStartTime = NAN;
+	std::deque<double> prepTime;
+
+	static std::vector<c4::rectangle<int>> work_rects(const std::vector<c4::rectangle<int>>& rects, int frameWidth, int frameHeight, const c4::matrix_dimensions& analysisSize, int downscale) {
 		std::vector<c4::rectangle<int>> scaled;
 		for (const c4::rectangle<int>& r : rects) {
-			scaled.emplace_back(r.x / downscale, r.y / downscale, r.w / downscale, r.h / downscale);
+			const int x = int((int64_t)r.x * analysisSize.width / frameWidth);
+			const int y = int((int64_t)r.y * analysisSize.height / frameHeight);
+			const int w = int((int64_t)r.w * analysisSize.width / frameWidth);
+			const int h = int((int64_t)r.h * analysisSize.height / frameHeight);
+			scaled.emplace_back(x / downscale, y / downscale, w / downscale, h / downscale);
 		}
 		return scaled;
 	}
 
-	c4::MotionDetector::Motion detect(AVFrame* src, const AVPixFmtDescriptor *pixdesc) {
-		STATIC_SCOPED_TIMER("VidStabProcessor::detect()");
+	// Params of the detectors other than c4, with their own scene cut threshold
+	static c4::VideoStabilization::Params detector_params(c4::VideoStabilization::Params params, const AnalysisParams& analysisParams) {
+		params.scene_cut_threshold = analysisParams.sceneCutThreshold;
+		return params;
+	}
+
+	static double frame_time(const AVFrame* frame) {
+		const int64_t ts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+		if (ts == AV_NOPTS_VALUE || frame->time_base.den == 0) {
+			THROW_EXCEPTION("Frame without timestamp, can't match it with the analysis input");
+		}
+		return ts * av_q2d(frame->time_base);
+	}
+
+	// Timestamps are matched relative to the first frame, so the files don't need the same start time
+	double source_time(const AVFrame* src) {
+		const double t = frame_time(src);
+		if (std::isnan(sourceStartTime)) {
+			sourceStartTime = t;
+		}
+		return t - sourceStartTime;
+	}
 
+	double analysis_time(const AVFrame* frame) {
+		const double t = frame_time(frame);
+		if (std::isnan(analysisStartTime)) {
+			analysisStartTime = t;
+		}
+		return t - analysisStartTime;
+	}
+
+	AVFrame* matching_analysis_frame(double t) {
+		if (analysisFrame == nullptr) {
+			analysisFrame = av_frame_alloc();
+			nextAnalysisFrame = av_frame_alloc();
+			if (!analysisReader->read(analysisFrame)) {
+				THROW_EXCEPTION("Analysis input has no video frames");
+			}
+			hasNextAnalysisFrame = analysisReader->read(nextAnalysisFrame);
+		}
+
+		while (hasNextAnalysisFrame && std::abs(analysis_time(nextAnalysisFrame) - t) <= std::abs(analysis_time(analysisFrame) - t)) {
+			std::swap(analysisFrame, nextAnalysisFrame);
+			av_frame_unref(nextAnalysisFrame);
+			hasNextAnalysisFrame = analysisReader->read(nextAnalysisFrame);
+		}
+
+		return analysisFrame;
+	}
+
+	// Integer factor box average of the luma plane, when it's a plain plane of 8 or 16 bit samples (planar
+	// and semi-planar YUV, gray). Single threaded: the decoder and encoder already keep every core busy,
+	// and the kernel is bound by memory bandwidth.
+	bool downscale_luma(const AVFrame* src, c4::VideoStabilization::Frame& frame) {
+		const AVPixFmtDescriptor* pixdesc = av_pix_fmt_desc_get((AVPixelFormat)src->format);
+		if (pixdesc == nullptr || (pixdesc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_FLOAT | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM))) {
+			return false;
+		}
+
+		const AVComponentDescriptor& luma = pixdesc->comp[0];
+		const int bits = luma.depth + luma.shift;
+		const int bytesPerSample = bits > 8 ? 2 : 1;
+		if (luma.plane != 0 || luma.offset != 0 || luma.step != bytesPerSample || bits < 8 || bits > 16) {
+			return false;
+		}
+
+		const int factor = src->width / frame.width();
+		if (factor < 1 || src->height / frame.height() != factor) {
+			return false;
+		}
+
+		const DownscaleLumaFunction kernel = downscale_luma_function(bytesPerSample, factor);
+		kernel(src->data[0], src->linesize[0], frame.data(), frame.stride(), frame.height(), frame.width(), factor, bits);
+
+		return true;
+	}
+
+	c4::VideoStabilization::FramePtr downscale_frame(AVFrame* src) {
 		c4::VideoStabilization::FramePtr frame = std::make_shared<c4::VideoStabilization::Frame>();
 
 		frame->resize(workHeight, workWidth);
+		if (downscale_luma(src, *frame)) {
+			return frame;
+		}
+
 		if (sws_downscale_ctx == nullptr) {
 			sws_downscale_ctx = sws_getContext(src->width, src->height, (AVPixelFormat)src->format, frame->width(), frame->height(), AV_PIX_FMT_GRAY8, SWS_AREA, 0, 0, 0);
 			ASSERT_TRUE(sws_downscale_ctx != nullptr);
@@ -293,20 +970,389 @@ class VidStabProcessor : public FfmpegVideoProcessor::FrameProcessor {
 		int ret = sws_scale(sws_downscale_ctx, src->data, src->linesize, 0, src->height, dst_data, dst_stride);
 		ASSERT_EQUAL(ret, frame->height());
 
-		const std::vector<c4::rectangle<int>> scaledIgnoreRects = downscale_rects(ignoreRects, downscale);
+		return frame;
+	}
 
-		return stabilizer.process(frame, scaledIgnoreRects);
+	c4::VideoStabilization::FramePtr read_proxy_frame() {
+		c4::VideoStabilization::FramePtr frame = proxyReader->read();
+		if (!frame) {
+			THROW_EXCEPTION("Analysis proxy has fewer frames than the input video");
+		}
+		return frame;
 	}
 
-	c4::matrix<uint8_t> srcPlaneCopy;
+	c4::MotionDetector::Motion analyze(c4::VideoStabilization::FramePtr frame) {
+		if (proxyWriter) {
+			proxyWriter->write(*frame);
+		}
+
+		if (analysisParams.detector == "c4") {
+			return stabilize(stabilizer, frame, scaledIgnoreRects);
+		}
+
+		return smoother.push(estimate(frame));
+	}
+
+	c4::MotionDetector::Motion match(const c4::VideoStabilization::Frame& prev, const c4::VideoStabilization::Frame& next, const std::vector<c4::rectangle<int>>& rects) {
+		if (analysisParams.detector == "phasecorr") {
+			return phaseDetector.detect(prev, next, rects);
+		}
+		if (analysisParams.detector == "features") {
+			return featureDetector.detect(prev, next, rects);
+		}
+		return blockDetector.detect(prev, next, rects);
+	}
+
+	static bool same_frame(const c4::VideoStabilization::Frame& a, const c4::VideoStabilization::Frame& b) {
+		if (a.height() != b.height() || a.width() != b.width()) {
+			return false;
+		}
+		for (int i = 0; i < a.height(); i++) {
+			if (!std::equal(a[i], a[i] + a.width(), b[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Raw motion from the previous analysis frame to this one.
+	// In adaptive mode frames are matched at a coarser downscale first, and only if confidence
+	// is low they are matched again at full work resolution.
+	c4::MotionDetector::Motion estimate(c4::VideoStabilization::FramePtr frame) {
+		STATIC_SCOPED_TIMER("VidStabProcessor::estimate()");
+
+		const int frameIndex = analyzedFrames++;
+		const int factor = analysisParams.adaptiveFactor;
+
+		// Duplicates of the previous frame, like repeated fields of telecined video or frozen frames,
+		// have no motion, there's no need to match them. Source frames are already caught before the downscale,
+		// so only frames of the analysis proxy are compared.
+		c4::MotionDetector::Motion motion;
+		if (proxyReader && prevFrame && same_frame(*prevFrame, *frame)) {
+			duplicateFrames++;
+			motion.confidence = 1;
+			prevFrame = frame;
+			return motion;
+		}
+
+		if (factor > 1) {
+			c4::VideoStabilization::FramePtr coarseFrame = downscale_box(*frame, factor);
+			if (prevFrame) {
+				motion = match(*prevCoarseFrame, *coarseFrame, coarseIgnoreRects);
+				motion.shift *= factor;
+
+				int usedDownscale = downscale * factor;
+				if (motion.confidence < analysisParams.refineThreshold) {
+					const c4::MotionDetector::Motion fineMotion = match(*prevFrame, *frame, scaledIgnoreRects);
+					if (fineMotion.confidence >= motion.confidence) {
+						motion = fineMotion;
+						usedDownscale = downscale;
+					}
+				}
+
+				LOGD << "Frame " << frameIndex << " analyzed at downscale " << usedDownscale << ", confidence " << motion.confidence;
+			}
+			prevCoarseFrame = coarseFrame;
+		} else if (prevFrame) {
+			motion = match(*prevFrame, *frame, scaledIgnoreRects);
+		}
+
+		prevFrame = frame;
+
+		return motion;
+	}
+
+	// Motion from the decoder's motion vectors. codec_mv matches pixels only for frames without vectors, against the
+	// previous frame, so every frame is downscaled but most aren't matched. hybrid uses the vectors to center a small block search.
+	c4::MotionDetector::Motion analyze_codec(AVFrame* src) {
+		const bool hybrid = analysisParams.motionSource == "hybrid";
+
+		// An analysis input with a lower frame rate gives the same frame to consecutive source frames. Its vectors
+		// were already used by the first of them, the repeats have no motion.
+		if (analysisReader) {
+			const double t = frame_time(src);
+			if (prevFrame && t == prevCodecTime) {
+				if (proxyWriter) {
+					proxyWriter->write(*prevFrame);
+				}
+				c4::MotionDetector::Motion motion;
+				motion.confidence = 1;
+				return smoother.push(motion);
+			}
+			prevCodecTime = t;
+		}
+
+		const c4::VideoStabilization::FramePtr frame = downscale_frame(src);
+		if (proxyWriter) {
+			proxyWriter->write(*frame);
+		}
+
+		c4::MotionDetector::Motion motion;
+		if (analyzedFrames++ > 0) {
+			const bool hasVectors = codecMotion.estimate(src, workWidth, workHeight, scaledIgnoreRects, motion);
+			if (hasVectors) {
+				codecMotionFrames++;
+			}
+
+			if (hybrid) {
+				motion = hasVectors ? blockDetector.detect_around(*prevFrame, *frame, scaledIgnoreRects, motion, analysisParams.blockMatching.refineRadius) : blockDetector.detect(*prevFrame, *frame, scaledIgnoreRects);
+			} else if (!hasVectors) {
+				motion = blockDetector.detect(*prevFrame, *frame, scaledIgnoreRects);
+			}
+
+			if (!hasVectors) {
+				codecMotion.update(src, motion);
+			}
+		}
+
+		prevFrame = frame;
+
+		return smoother.push(motion);
+	}
+
+	// Motion from the gyro track. Frames are only downscaled for gyro_fusion, so the image isn't analyzed at all
+	// otherwise. Frames the track doesn't cover get the detector's motion with gyro_fusion, and are scene cuts without it.
+	c4::MotionDetector::Motion analyze_gyro(AVFrame* src) {
+		const double t = frame_time(src) + analysisParams.gyroOffset;
+
+		c4::VideoStabilization::FramePtr frame;
+		if (analysisParams.gyroFusion || proxyWriter) {
+			frame = downscale_frame(src);
+		}
+		if (proxyWriter) {
+			proxyWriter->write(*frame);
+		}
+
+		c4::MotionDetector::Motion motion;
+		if (analyzedFrames++ > 0) {
+			const bool hasGyro = gyro->motion(prevGyroTime, t, workWidth, workHeight, analysisParams.gyroFov, motion);
+			if (hasGyro) {
+				gyroMotionFrames++;
+			}
+
+			if (analysisParams.gyroFusion) {
+				const c4::MotionDetector::Motion imageMotion = match(*prevFrame, *frame, scaledIgnoreRects);
+				motion = hasGyro ? fuse_motion(motion, imageMotion) : imageMotion;
+			}
+		}
+
+		prevFrame = frame;
+		prevGyroTime = t;
+
+		return smoother.push(motion);
+	}
+
+	c4::MotionDetector::Motion analyze(AVFrame* frame) {
+		if (analysisParams.motionSource == "gyro") {
+			return analyze_gyro(frame);
+		}
+		if (analysisParams.motionSource != "pixels") {
+			return analyze_codec(frame);
+		}
+
+		// Duplicates of the previous frame aren't downscaled, they reuse its work frame. Only every few luma rows are
+		// compared, frames that differ in the others alone have no motion to speak of.
+		const uint64_t hash = frame_hash(frame, 1, duplicateRowStep);
+		if (prevWorkFrame && hash == prevSourceHash) {
+			duplicateFrames++;
+			if (proxyWriter) {
+				proxyWriter->write(*prevWorkFrame);
+			}
+			// c4 keeps its own frame history and still sees every frame, so its smoothing window counts video frames
+			if (analysisParams.detector == "c4") {
+				return stabilize(stabilizer, prevWorkFrame, scaledIgnoreRects);
+			}
+			analyzedFrames++;
+			c4::MotionDetector::Motion motion;
+			motion.confidence = 1;
+			return smoother.push(motion);
+		}
+
+		prevSourceHash = hash;
+		prevWorkFrame = downscale_frame(frame);
+		return analyze(prevWorkFrame);
+	}
+
+	c4::MotionDetector::Motion detect(AVFrame* src, const AVPixFmtDescriptor *pixdesc) {
+		STATIC_SCOPED_TIMER("VidStabProcessor::detect()");
+
+		if (proxyReader) {
+			return analyze(read_proxy_frame());
+		}
+
+		if (analysisReader) {
+			return analyze(matching_analysis_frame(source_time(src)));
+		}
+
+		return analyze(src);
+	}
+
+	// Planar copies of the components: sources of the warp, their prefiltered versions for downscaling,
+	// and destinations of components interleaved with others
+	template<class T>
+	struct WarpBuffers {
+		std::vector<c4::matrix<T>> src;
+		std::vector<c4::matrix<T>> prefiltered;
+		std::vector<c4::matrix<T>> dst;
+	};
+	WarpBuffers<uint8_t> warpBuffers8;
+	WarpBuffers<uint16_t> warpBuffers16;
+
+	template<class T>
+	void imprint_debug_info(c4::matrix_ref<T>& plane, int depth, const c4::MotionDetector::Motion& motion, double zoom) {
+		const T fg = T((1 << depth) - 1);
+		const T bg = 0;
+		c4::draw_string(plane, 20, 15, "frame " + c4::to_string(frameCounter++, 4), fg, bg, 2);
+
+		c4::draw_string(plane, 20, 45, "shift: " + c4::to_string(motion.shift.x, 2) + ", " + c4::to_string(motion.shift.y, 2)
+			+ ", scale: " + c4::to_string(motion.scale * zoom, 4)
+			+ ", alpha: " + c4::to_string(motion.alpha, 4), fg, bg, 2);
+
+		if (zoom != 1.) {
+			c4::draw_string(plane, 20, 75, "zoom: " + c4::to_string(zoom, 4), fg, bg, 2);
+		}
+	}
+
+	// Warps components [begin, end) of src into dst, all of the same size and depth, in one pass. A component that is a plane
+	// of its own is read and written right in the frame, one interleaved with others (NV12 chroma, packed RGB and YUYV)
+	// goes through planar buffers. The warp can't be in place, so src planes are copied when dst is src.
+	// Downscaling by 2 or more along an axis averages the source along it first, so the bilinear warp doesn't alias.
+	// dst may have another pixel format: chroma subsampling changes like a resize, and bit depth in the warp's stores.
+	template<class T, class U>
+	void warp_components(const AVFrame* src, AVFrame* dst, const AVPixFmtDescriptor* srcPixdesc, const AVPixFmtDescriptor* dstPixdesc, int begin, int end, const c4::MotionDetector::Motion& motion, double zoom, WarpBuffers<T>& srcBuffers, WarpBuffers<U>& dstBuffers) {
+		srcBuffers.src.resize(srcPixdesc->nb_components);
+		srcBuffers.prefiltered.resize(srcPixdesc->nb_components);
+		dstBuffers.dst.resize(dstPixdesc->nb_components);
+
+		// Each axis is prefiltered on its own, so 4:2:2 to 4:2:0 chroma is averaged vertically only
+		const bool nearest = interpolation == WarpInterpolation::nearest;
+		const int prefilterX = nearest ? 1 : std::max(1, component_width(src, srcPixdesc, begin) / component_width(dst, dstPixdesc, begin));
+		const int prefilterY = nearest ? 1 : std::max(1, component_height(src, srcPixdesc, begin) / component_height(dst, dstPixdesc, begin));
+
+		std::vector<c4::matrix_ref<T>> srcPlanes;
+		std::vector<c4::matrix_ref<U>> dstPlanes;
+		for (int c = begin; c < end; c++) {
+			const AVComponentDescriptor& comp = srcPixdesc->comp[c];
+			const int h = component_height(src, srcPixdesc, c);
+			const int w = component_width(src, srcPixdesc, c);
+			const uint8_t* srcData = src->data[comp.plane] + comp.offset;
+
+			const bool direct = component_is_plane<T>(comp) && src != dst;
+			if (!direct) {
+				srcBuffers.src[c].resize(h, w);
+				read_component(srcData, src->linesize[comp.plane], comp.step, comp.shift, srcBuffers.src[c]);
+			}
+			const c4::matrix_ref<T> plane = direct ? c4::matrix_ref<T>(h, w, src->linesize[comp.plane] / (int)sizeof(T), (T*)srcData) : srcBuffers.src[c];
+			if (prefilterX > 1 || prefilterY > 1) {
+				box_downscale(plane, prefilterY, prefilterX, srcBuffers.prefiltered[c]);
+				srcPlanes.push_back(srcBuffers.prefiltered[c]);
+			} else {
+				srcPlanes.push_back(plane);
+			}
+
+			const AVComponentDescriptor& dstComp = dstPixdesc->comp[c];
+			const int dh = component_height(dst, dstPixdesc, c);
+			const int dw = component_width(dst, dstPixdesc, c);
+			if (component_is_plane<U>(dstComp)) {
+				dstPlanes.emplace_back(dh, dw, dst->linesize[dstComp.plane] / (int)sizeof(U), (U*)(dst->data[dstComp.plane] + dstComp.offset));
+			} else {
+				dstBuffers.dst[c].resize(dh, dw);
+				dstPlanes.push_back(dstBuffers.dst[c]);
+			}
+		}
+
+		// Motion is in work frame pixels
+		c4::MotionDetector::Motion planeMotion = motion;
+		planeMotion.shift.y *= (double)srcPlanes[0].height() / workHeight;
+		planeMotion.shift.x *= (double)srcPlanes[0].width() / workWidth;
+
+		SampleConversion conversion;
+		conversion.srcDepth = srcPixdesc->comp[begin].depth;
+		conversion.dstDepth = dstPixdesc->comp[begin].depth;
+		conversion.dither = dither;
+		apply_motion(planeMotion, srcPlanes, dstPlanes, interpolation, conversion);
+
+		if (begin == 0 && debugImprint) {
+			imprint_debug_info(dstPlanes[0], dstPixdesc->comp[0].depth, motion, zoom);
+		}
+
+		for (int c = begin; c < end; c++) {
+			const AVComponentDescriptor& dstComp = dstPixdesc->comp[c];
+			if (!component_is_plane<U>(dstComp)) {
+				write_component(dstBuffers.dst[c], dst->data[dstComp.plane] + dstComp.offset, dst->linesize[dstComp.plane], dstComp.step, dstComp.shift);
+			}
+		}
+	}
+
+	template<class T>
+	void warp_components(const AVFrame* src, AVFrame* dst, const AVPixFmtDescriptor* srcPixdesc, const AVPixFmtDescriptor* dstPixdesc, int begin, int end, const c4::MotionDetector::Motion& motion, double zoom, WarpBuffers<T>& srcBuffers) {
+		if (dstPixdesc->comp[begin].depth > 8) {
+			warp_components(src, dst, srcPixdesc, dstPixdesc, begin, end, motion, zoom, srcBuffers, warpBuffers16);
+		} else {
+			warp_components(src, dst, srcPixdesc, dstPixdesc, begin, end, motion, zoom, srcBuffers, warpBuffers8);
+		}
+	}
 
 public:
-	VidStabProcessor(const c4::VideoStabilization::Params& params, int frameWidth, int frameHeight, int downscale, const std::vector<c4::rectangle<int>> ignoreRects, double prezoom, bool autozoom, double zoomSpeed, bool debugImprint)
-		: stabilizer(params), frameWidth(frameWidth), frameHeight(frameHeight), downscale(downscale), workWidth(frameWidth / downscale), workHeight(frameHeight / downscale), ignoreRects(ignoreRects), prezoom(prezoom), autozoom(autozoom), zoomSpeed(zoomSpeed), debugImprint(debugImprint) {
+	VidStabProcessor(const c4::VideoStabilization::Params& params, const AnalysisParams& analysisParams, int frameWidth, int frameHeight, const c4::matrix_dimensions& analysisSize, int downscale, const std::vector<c4::rectangle<int>> ignoreRects, double prezoom, bool autozoom, double zoomSpeed, bool debugImprint, bool dither, double passthroughThreshold, WarpInterpolation interpolation)
+		: stabilizer(params), analysisParams(analysisParams), blockDetector(detector_params(params, analysisParams), analysisParams.blockMatching), phaseDetector(params, analysisParams.logPolar), featureDetector(params, analysisParams.maxFeatures, analysisParams.blockMatching.fit), codecMotion(params, analysisParams.blockMatching.fit), smoother(detector_params(params, analysisParams)), frameWidth(frameWidth), frameHeight(frameHeight), analysisSize(analysisSize), downscale(downscale), workWidth(analysisSize.width / downscale), workHeight(analysisSize.height / downscale)
+		, ignoreRects(ignoreRects), scaledIgnoreRects(work_rects(ignoreRects, frameWidth, frameHeight, analysisSize, downscale)), coarseIgnoreRects(downscale_rects(scaledIgnoreRects, std::max(analysisParams.adaptiveFactor, 1))), prezoom(prezoom), autozoom(autozoom), zoomSpeed(zoomSpeed), debugImprint(debugImprint), dither(dither), passthroughThreshold(passthroughThreshold), interpolation(interpolation) {
 		ASSERT_GREATER_EQUAL(prezoom, 1.);
 		ASSERT_GREATER_EQUAL(zoomSpeed, 1.);
 	}
 
+	void set_proxy_input(std::unique_ptr<AnalysisProxyReader> reader) {
+		ASSERT_EQUAL(reader->width(), workWidth);
+		ASSERT_EQUAL(reader->height(), workHeight);
+		proxyReader = std::move(reader);
+	}
+
+	void set_proxy_output(const std::string& filename) {
+		proxyWriter = std::make_unique<AnalysisProxyWriter>(filename, workWidth, workHeight, downscale, frameWidth, frameHeight);
+	}
+
+	void set_analysis_input(std::unique_ptr<FfmpegVideoReader> reader) {
+		analysisReader = std::move(reader);
+	}
+
+	void set_gyro_input(std::unique_ptr<GyroMotion> track) {
+		gyro = std::move(track);
+	}
+
+	// Whether motion detection needs the decoded source frames
+	bool analyzes_source() const {
+		return proxyReader == nullptr && analysisReader == nullptr;
+	}
+
+	// Same as running preprocess() on every decoded frame, but the frames come from the analysis proxy.
+	void preprocess_proxy() {
+		STATIC_SCOPED_TIMER("VidStabProcessor::preprocess_proxy()");
+
+		c4::progress_indicator progress(proxyReader->size(), "Pre-processing proxy frames");
+		while (c4::VideoStabilization::FramePtr frame = proxyReader->read()) {
+			preprocessed.push_back(analyze(frame));
+			progress.did_some(1);
+		}
+		progress.print_final();
+	}
+
+	// Pre-processing pass over the analysis input, the source video is not decoded.
+	// Motions are matched to source frames by timestamp in process().
+	void preprocess_analysis_input() {
+		STATIC_SCOPED_TIMER("VidStabProcessor::preprocess_analysis_input()");
+
+		c4::progress_indicator progress(analysisReader->frame_count(), "Pre-processing analysis input frames");
+		AVFrame* frame = av_frame_alloc();
+		while (analysisReader->read(frame)) {
+			prepTime.push_back(analysis_time(frame));
+			preprocessed.push_back(analyze(frame));
+			av_frame_unref(frame);
+			progress.did_some(1);
+		}
+		av_frame_free(&frame);
+		progress.print_final();
+	}
+
 	void preprocess(AVFrame* src) override {
 		c4::MotionDetector::Motion motion = detect(src, av_pix_fmt_desc_get((AVPixelFormat)src->format));
 
@@ -386,17 +1432,27 @@ public:
 		PRINT_DEBUG(maxZoom);
 	}
 
-	void process(AVFrame* src) override {
+	void process(AVFrame* src, AVFrame* dst) override {
 		STATIC_SCOPED_TIMER("VidStabProcessor::process()");
 
 		ASSERT_TRUE(src != nullptr);
-		AV_CALL(av_frame_make_writable(src));
+		ASSERT_TRUE(dst != nullptr);
 
 		const AVPixFmtDescriptor *pixdesc = av_pix_fmt_desc_get((AVPixelFormat)src->format);
+		const AVPixFmtDescriptor *dstPixdesc = av_pix_fmt_desc_get((AVPixelFormat)dst->format);
 
 		c4::MotionDetector::Motion motion;
 		double zoom = prezoom;
-		if (!preprocessed.empty()) {
+		if (!prepTime.empty()) {
+			const double t = source_time(src);
+			while (prepTime.size() > 1 && std::abs(prepTime[1] - t) <= std::abs(prepTime[0] - t)) {
+				prepTime.pop_front();
+				preprocessed.pop_front();
+				prepZoom.pop_front();
+			}
+			motion = preprocessed.front();
+			zoom = prepZoom.front();
+		} else if (!preprocessed.empty()) {
 			motion = preprocessed.front();
 			preprocessed.pop_front();
 			zoom = prepZoom.front();
@@ -408,66 +1464,163 @@ public:
 		motion.scale *= 1. / zoom;
 		motion.shift *= 1. / zoom;
 
-		const int planes = pixdesc->nb_components;
-		ASSERT_EQUAL(planes, av_pix_fmt_count_planes((AVPixelFormat)src->format));
+		// Runs with --max_alpha 0 --max_scale 1 and static scenes leave a pure shift, which has a faster warp
+		snap_to_translation(motion, workWidth, workHeight);
+		processedFrames++;
+
+		// Tripod and gimbal shots often need no correction at all, the warp would only blur them slightly.
+		// Only in place: a separate dst is there because the output size or format differs.
+		if (passthroughThreshold > 0 && !debugImprint && dst == src) {
+			c4::MotionDetector::Motion frameMotion = motion;
+			frameMotion.shift.x *= (double)src->width / workWidth;
+			frameMotion.shift.y *= (double)src->height / workHeight;
+			if (max_displacement(frameMotion, src->width, src->height) < passthroughThreshold) {
+				passthroughFrames++;
+				reuseHash = false;
+				return;
+			}
+		}
 
-		STATIC_SCOPED_TIMER("VidStabProcessor::process(): apply");
+		// Only an in place warp writes to src. The decoder may still reference its buffer, which then gets copied.
+		if (dst == src) {
+			AV_CALL(av_frame_make_writable(src));
+		}
 
-		for (int p = 0; p < planes; p++) {
-			const int h = p ? AV_CEIL_RSHIFT(src->height, pixdesc->log2_chroma_h) : src->height;
-			const int w = p ? AV_CEIL_RSHIFT(src->width, pixdesc->log2_chroma_w) : src->width;
-			c4::MotionDetector::Motion planeSizeAdjustedMotion = motion;
-			planeSizeAdjustedMotion.shift.y *= (double)h / workHeight;
-			planeSizeAdjustedMotion.shift.x *= (double)w / workWidth;
+		// The smoothed correction of a static run of duplicates stays the same, so does the warped frame.
+		// A separate dst still holds it, an in place one gets a copy.
+		const bool sameMotion = !debugImprint && motion.shift.x == prevMotion.shift.x && motion.shift.y == prevMotion.shift.y && motion.alpha == prevMotion.alpha && motion.scale == prevMotion.scale;
+		prevMotion = motion;
+		if (sameMotion) {
+			const uint64_t hash = frame_hash(src);
+			if (reuseHash && hash == prevHash) {
+				if (dst == src) {
+					AV_CALL(av_frame_copy(dst, prevOutput));
+				}
+				reusedFrames++;
+				return;
+			}
+			reuseHash = true;
+			prevHash = hash;
+		} else {
+			reuseHash = false;
+		}
 
-			if (pixdesc->comp[p].depth == 8) {
-				ASSERT_EQUAL(pixdesc->comp[p].step, 1);
+		if (!warpable_format(pixdesc)) {
+			THROW_EXCEPTION(std::string("Unsupported pixel format: ") + (pixdesc ? pixdesc->name : "unknown"));
+		}
+		if (!warpable_format(dstPixdesc)) {
+			THROW_EXCEPTION(std::string("Unsupported output pixel format: ") + (dstPixdesc ? dstPixdesc->name : "unknown"));
+		}
 
-				c4::matrix_ref<uint8_t> planeRef(h, w, src->linesize[p], src->data[p] + pixdesc->comp[p].offset);
-				srcPlaneCopy = planeRef;
-				planeSizeAdjustedMotion.apply(srcPlaneCopy, planeRef);
+		STATIC_SCOPED_TIMER("VidStabProcessor::process(): apply");
 
-				if (p == 0 && debugImprint) {
-					c4::draw_string(planeRef, 20, 15, "frame " + c4::to_string(frameCounter++, 4), uint8_t(255), uint8_t(0), 2);
+		// Consecutive components of the same size and depth in both frames share source coordinates and are warped
+		// in one pass: chroma of 4:2:0 and 4:2:2 frames, and all components of 4:4:4 and RGB ones
+		auto same_layout = [&](int a, int b) {
+			return component_height(src, pixdesc, a) == component_height(src, pixdesc, b) && component_width(src, pixdesc, a) == component_width(src, pixdesc, b)
+				&& component_height(dst, dstPixdesc, a) == component_height(dst, dstPixdesc, b) && component_width(dst, dstPixdesc, a) == component_width(dst, dstPixdesc, b)
+				&& pixdesc->comp[a].depth == pixdesc->comp[b].depth && dstPixdesc->comp[a].depth == dstPixdesc->comp[b].depth;
+		};
+
+		// Alpha of the source is dropped if the output has none
+		const int components = std::min(pixdesc->nb_components, dstPixdesc->nb_components);
+		for (int c = 0; c < components;) {
+			int groupEnd = c + 1;
+			while (groupEnd < components && same_layout(c, groupEnd)) {
+				groupEnd++;
+			}
 
-					c4::draw_string(planeRef, 20, 45, "shift: " + c4::to_string(motion.shift.x, 2) + ", " + c4::to_string(motion.shift.y, 2)
-						+ ", scale: " + c4::to_string(motion.scale * zoom, 4)
-						+ ", alpha: " + c4::to_string(motion.alpha, 4), uint8_t(255), uint8_t(0), 2);
+			if (pixdesc->comp[c].depth > 8) {
+				warp_components(src, dst, pixdesc, dstPixdesc, c, groupEnd, motion, zoom, warpBuffers16);
+			} else {
+				warp_components(src, dst, pixdesc, dstPixdesc, c, groupEnd, motion, zoom, warpBuffers8);
+			}
 
-					if (zoom != 1.) {
-						c4::draw_string(planeRef, 20, 75, "zoom: " + c4::to_string(zoom, 4), uint8_t(255), uint8_t(0), 2);
-					}
-				}
-			}else{
-				ASSERT_TRUE(pixdesc->comp[p].depth > 8 && pixdesc->comp[p].depth <= 16);
-				ASSERT_EQUAL(pixdesc->comp[p].step, 2);
+			c = groupEnd;
+		}
 
-				c4::matrix_ref<uint16_t> planeRef(h, w, src->linesize[p] / 2, (uint16_t*)(src->data[p] + pixdesc->comp[p].offset));
-				c4::matrix<uint16_t> srcPlaneCopy = planeRef;
-				planeSizeAdjustedMotion.apply(srcPlaneCopy, planeRef);
+		// and output alpha missing from the source is opaque
+		for (int c = components; c < dstPixdesc->nb_components; c++) {
+			const AVComponentDescriptor& comp = dstPixdesc->comp[c];
+			const int h = component_height(dst, dstPixdesc, c);
+			const int w = component_width(dst, dstPixdesc, c);
+			const int opaque = (1 << comp.depth) - 1;
+			if (comp.depth > 8) {
+				fill_component<uint16_t>(dst->data[comp.plane] + comp.offset, dst->linesize[comp.plane], comp.step, comp.shift, h, w, uint16_t(opaque));
+			} else {
+				fill_component<uint8_t>(dst->data[comp.plane] + comp.offset, dst->linesize[comp.plane], comp.step, comp.shift, h, w, uint8_t(opaque));
+			}
+		}
 
-				if (p == 0 && debugImprint) {
-					const uint16_t fg = (1 << pixdesc->comp[p].depth) - 1;
-					const uint16_t bg = 0;
-					c4::draw_string(planeRef, 20, 15, "frame " + c4::to_string(frameCounter++, 4), fg, bg, 2);
+		if (prevOutput == nullptr) {
+			prevOutput = av_frame_alloc();
+			ASSERT_TRUE(prevOutput != nullptr);
+		}
+		av_frame_unref(prevOutput);
+		if (reuseHash && dst == src) {
+			AV_CALL(av_frame_ref(prevOutput, dst));
+		}
+	}
 
-					c4::draw_string(planeRef, 20, 45, "shift: " + c4::to_string(motion.shift.x, 2) + ", " + c4::to_string(motion.shift.y, 2)
-						+ ", scale: " + c4::to_string(motion.scale * zoom, 4)
-						+ ", alpha: " + c4::to_string(motion.alpha, 4), fg, bg, 2);
+	// A proxy of another clip with the same frame size is only caught by its length: a shorter one runs out
+	// in read_proxy_frame(), a longer one is left over when all the input frames are processed
+	void check_proxy_length() const {
+		if (proxyReader && proxyReader->size() != processedFrames) {
+			THROW_EXCEPTION("Analysis proxy has " + std::to_string(proxyReader->size()) + " frames, but the input video has " + std::to_string(processedFrames));
+		}
+	}
 
-					if (zoom != 1.) {
-						c4::draw_string(planeRef, 20, 75, "zoom: " + c4::to_string(zoom, 4), fg, bg, 2);
-					}
-				}
-			}
+	void print_stats() const {
+		if (analysisParams.detector == "blocks") {
+			LOGD << "Block search " << search_strategy_name(analysisParams.blockMatching.search) << ": " << blockDetector.average_sad_evaluations() << " SAD evaluations per block";
+			LOGD << "Textureless blocks skipped: " << 100 * blockDetector.textureless_share() << "%";
 		}
+		if (analysisParams.detector == "features") {
+			LOGD << "Features: " << featureDetector.average_features() << " per frame, " << 100 * featureDetector.tracked_share() << "% tracked";
+		}
+		if (analysisParams.motionSource == "gyro") {
+			LOGD << "Gyro motion used for " << gyroMotionFrames << " of " << analyzedFrames << " frames";
+		} else if (analysisParams.motionSource != "pixels") {
+			LOGD << "Codec motion vectors used for " << codecMotionFrames << " of " << analyzedFrames << " frames";
+		}
+		LOGD << "Warp skipped for " << passthroughFrames << " of " << processedFrames << " frames";
+		LOGD << "Duplicate frames: " << duplicateFrames << " not downscaled, " << reusedFrames << " reused the previous output";
 	}
 
 	~VidStabProcessor() override {
 		sws_freeContext(sws_downscale_ctx);
+		av_frame_free(&analysisFrame);
+		av_frame_free(&nextAnalysisFrame);
+		av_frame_free(&prevOutput);
 	}
 };
 
+// "WxH" with positive width and height, an empty string leaves size as it is
+static bool parse_size(const std::string& s, c4::matrix_dimensions& size) {
+	if (s.empty()) {
+		return true;
+	}
+
+	const size_t x = s.find('x');
+	if (x == std::string::npos) {
+		return false;
+	}
+
+	try {
+		size_t wEnd = 0;
+		size_t hEnd = 0;
+		const int width = std::stoi(s.substr(0, x), &wEnd);
+		const int height = std::stoi(s.substr(x + 1), &hEnd);
+		if (wEnd != x || hEnd != s.size() - x - 1 || width <= 0 || height <= 0) {
+			return false;
+		}
+		size = c4::matrix_dimensions{ .height = height, .width = width };
+	} catch (const std::exception& e) {
+		return false;
+	}
+	return true;
+}
+
 static int64_t parse_bitrate(const std::string& bitrate) {
 	if (bitrate == "0") {
 		return 0;
@@ -512,6 +1665,10 @@ int main(int argc, char* argv[]) {
 		auto inputCmdOpt = opts.add_required_free_arg<std::string>("input.mp4");
 		auto outputCmdOpt = opts.add_required_free_arg<std::string>("output.mp4");
 		auto bitrateCmdOpt = opts.add_optional<std::string>("bitrate", "0", "Target bitrate.");
+		auto previewCmdOpt = opts.add_flag("preview", "Fast low quality render to check the settings: full analysis, but the output is a quarter of the input size unless output_size is set, warped with nearest neighbor sampling and encoded with the fastest preset. Audio and subtitles are dropped.");
+		auto outputPixFmtCmdOpt = opts.add_optional<std::string>("output_pix_fmt", "", "Output pixel format, e.g. yuv420p. The warp writes it directly, converting bit depth and chroma subsampling. Default is the input format.");
+		auto ditherCmdOpt = opts.add_flag("dither", "Ordered dither when output_pix_fmt has fewer bits per sample than the input, instead of rounding. Avoids banding in gradients.");
+		auto outputSizeCmdOpt = opts.add_optional<std::string>("output_size", "", "Output frame size WxH, e.g. 1920x1080. The warp resizes the stabilized frames, downscaling by 2 or more averages pixel blocks first. Default is the input size.");
 		auto codecCmdOpt = opts.add_optional<std::string>("codec", "libx265", "Output video codec. Default is libx265. You can use libx264, but you shouldn't. If you have nvidia drivers, you can try hevc_nvenc - it's faster, but has some pixel format limitations.");
 		auto downscaleCmdOpt = opts.add_optional<int>("downscale", -1, "Downscale factor used for motion detection. Default value of -1 means automatic (based on resolution).");
 		auto prezoomCmdOpt = opts.add_optional<double>("prezoom", 1.0, "Pre-zoom the source this much.");
@@ -523,15 +1680,40 @@ int main(int argc, char* argv[]) {
 		auto scaleSmoothCmdOpt = opts.add_optional<int>("scale_smooth", params.scale_smooth, "How many frames should be used for scale smoothing.");
 		auto alphaSmoothCmdOpt = opts.add_optional<int>("alpha_smooth", params.alpha_smooth, "How many frames should be used for rotation smoothing.");
 		auto sceneCutThresholdCmdOpt = opts.add_optional<double>("scene_cut_threshold", params.scene_cut_threshold, "Motion detection confidence threshold for scene cut detection.");
+		auto detectorCutThresholdCmdOpt = opts.add_optional<double>("detector_cut_threshold", 0.1, "Scene cut confidence threshold of the blocks, phasecorr and features detectors, and of the codec_mv and gyro motion sources. scene_cut_threshold applies to the c4 detector only.");
 		auto blocksizeCmdOpt = opts.add_optional<int>("block_size", params.blockSize, "Block size in pixels (after downscale).");
 		auto maxShiftCmdOpt = opts.add_optional<int>("max_shift", params.maxShift, "Max shift in pixels (after downscale), should be <= block_size / 2.");
 		auto maxAlphaCmdOpt = opts.add_optional<double>("max_alpha", params.maxAlpha, "Max rotation angle of consecutive frames, in radians.");
 		auto maxScaleCmdOpt = opts.add_optional<double>("max_scale", params.maxScale, "Max scale ratio of consecutive frames (1 / max_scale if we scale down).");
 
+		auto analysisInputCmdOpt = opts.add_optional<std::string>("analysis_input", "", "Run motion detection on this video (e.g. a low resolution proxy of the input), frames are matched by timestamp.");
+		auto proxyInCmdOpt = opts.add_optional<std::string>("proxy_in", "", "Read motion detection frames from an analysis proxy file instead of decoding them. The downscale factor is taken from the proxy.");
+		auto proxyOutCmdOpt = opts.add_optional<std::string>("proxy_out", "", "Save motion detection frames to an analysis proxy file for faster re-analysis.");
+
+		auto detectorCmdOpt = opts.add_optional<std::string>("detector", "", "Motion detector: c4, blocks, phasecorr or features. Default is c4, or the detector the other detection options need.");
+		auto logPolarCmdOpt = opts.add_flag("log_polar", "Also estimate rotation and scale with the phasecorr detector, by log-polar phase correlation.");
+		auto maxFeaturesCmdOpt = opts.add_optional<int>("max_features", 300, "Number of corners tracked by the features detector.");
+		auto motionSourceCmdOpt = opts.add_optional<std::string>("motion_source", "pixels", "Motion source: pixels, codec_mv (motion vectors of the input stream), hybrid (codec vectors refined by block matching) or gyro (gyroscope metadata of the input). Uses the blocks detector.");
+		auto gyroFovCmdOpt = opts.add_optional<double>("gyro_fov", 118, "Horizontal field of view of the camera in degrees, for motion_source gyro.");
+		auto gyroOffsetCmdOpt = opts.add_optional<double>("gyro_offset", 0, "Delay of the gyro track relative to the video in seconds, for motion_source gyro.");
+		auto gyroAxesCmdOpt = opts.add_optional<std::string>("gyro_axes", "", "Camera axes (X right, Y down, Z forward) of the gyro channels, e.g. \"ZXY\", lowercase negates. Taken from the stream by default.");
+		auto gyroFusionCmdOpt = opts.add_flag("gyro_fusion", "Correct gyro motion by image based motion detection, weighted by its confidence.");
+		auto adaptiveDownscaleCmdOpt = opts.add_optional<int>("adaptive_downscale", 0, "Analyze frames at this many times bigger downscale first, and repeat at the normal downscale only when confidence is low. Uses the blocks detector.");
+		auto refineThresholdCmdOpt = opts.add_optional<double>("refine_threshold", 0.3, "Confidence below which adaptive_downscale repeats motion detection at the normal downscale.");
+		auto pyramidLevelsCmdOpt = opts.add_optional<int>("pyramid_levels", 1, "Image pyramid levels for coarse to fine block matching, max_shift applies to the coarsest level. Uses the blocks detector.");
+		auto searchCmdOpt = opts.add_optional<std::string>("search", "exhaustive", "Block matching search: exhaustive, diamond, hexagon or sea (successive elimination).");
+		auto refineRadiusCmdOpt = opts.add_optional<int>("refine_radius", 2, "Block matching search radius on the finer pyramid levels.");
+		auto temporalPredictionCmdOpt = opts.add_flag("temporal_prediction", "Center block matching search on the previous frame motion, and shrink the search window while confidence is high. Uses the blocks detector.");
+		auto minSearchRadiusCmdOpt = opts.add_optional<int>("min_search_radius", 4, "Smallest search radius temporal_prediction shrinks the window to.");
+		auto minTextureCmdOpt = opts.add_optional<double>("min_texture", 0, "Skip blocks with lower pixel standard deviation in block matching. Uses the blocks detector.");
+		auto maxBlocksCmdOpt = opts.add_optional<int>("max_blocks", 0, "Match only this many most textured blocks, 0 means all. Uses the blocks detector.");
+		auto fitCmdOpt = opts.add_optional<std::string>("fit", "trimmed", "Outlier rejection of the motion fit to block shifts: trimmed, irls or ransac. Uses the blocks detector.");
+
 		auto ignoreCmdOpt = opts.add_multiple("ignore", "Add rectangle where motion should be ignored. Format: \"x, y, w, h\".");
 
 		auto debugCmdOpt = opts.add_flag("debug", "Enable debug output.");
 		auto debugImprintCmdOpt = opts.add_flag("debug_imprint", "Enable motion info imprint on the output video.");
+		auto passthroughThresholdCmdOpt = opts.add_optional<double>("passthrough_threshold", 0, "Frames the correction moves by less than this many pixels anywhere are output without warping, e.g. 0.05. 0 (default) warps every frame.");
 		auto verboseCmdOpt = opts.add_flag("verbose", "Enable verbose output.");
 
 		opts.set_package("ffstabilize");
@@ -552,10 +1734,23 @@ int main(int argc, char* argv[]) {
 			c4::Logger::setLogLevel(c4::LOG_VERBOSE);
 		}
 
+		LOGD << "CPU dispatch: " << cpu_isa_name(cpu_isa());
+
 		const std::string inputFilename = inputCmdOpt;
 		const std::string outputFilename = outputCmdOpt;
 		const int64_t bitrate = parse_bitrate(bitrateCmdOpt);
 
+		c4::matrix_dimensions outputSize{ .height = 0, .width = 0 };
+		if (!parse_size(outputSizeCmdOpt, outputSize)) {
+			THROW_EXCEPTION("Invalid output_size: " + (std::string)outputSizeCmdOpt);
+		}
+
+		const std::string outputPixFmtName = outputPixFmtCmdOpt;
+		const AVPixelFormat outputPixFmt = outputPixFmtName.empty() ? AV_PIX_FMT_NONE : av_get_pix_fmt(outputPixFmtName.c_str());
+		if (!outputPixFmtName.empty() && outputPixFmt == AV_PIX_FMT_NONE) {
+			THROW_EXCEPTION("Invalid output_pix_fmt: " + outputPixFmtName);
+		}
+
 		params.x_smooth = xSmoothCmdOpt;
 		params.y_smooth = ySmoothCmdOpt;
 		params.scale_smooth = scaleSmoothCmdOpt;
@@ -567,6 +1762,109 @@ int main(int argc, char* argv[]) {
 		params.maxAlpha = maxAlphaCmdOpt;
 		params.maxScale = maxScaleCmdOpt;
 
+		AnalysisParams analysisParams;
+		analysisParams.logPolar = logPolarCmdOpt;
+		analysisParams.maxFeatures = maxFeaturesCmdOpt;
+		analysisParams.adaptiveFactor = adaptiveDownscaleCmdOpt;
+		analysisParams.refineThreshold = refineThresholdCmdOpt;
+		analysisParams.sceneCutThreshold = detectorCutThresholdCmdOpt;
+		analysisParams.motionSource = (std::string)motionSourceCmdOpt;
+		analysisParams.gyroFov = gyroFovCmdOpt * std::numbers::pi / 180;
+		analysisParams.gyroOffset = gyroOffsetCmdOpt;
+		analysisParams.gyroFusion = gyroFusionCmdOpt;
+		analysisParams.blockMatching.pyramidLevels = pyramidLevelsCmdOpt;
+		analysisParams.blockMatching.refineRadius = refineRadiusCmdOpt;
+		analysisParams.blockMatching.temporalPrediction = temporalPredictionCmdOpt;
+		analysisParams.blockMatching.minSearchRadius = minSearchRadiusCmdOpt;
+		analysisParams.blockMatching.minTexture = minTextureCmdOpt;
+		analysisParams.blockMatching.maxBlocks = maxBlocksCmdOpt;
+
+		if (!parse_search_strategy(searchCmdOpt, analysisParams.blockMatching.search)) {
+			THROW_EXCEPTION("Unknown search: " + (std::string)searchCmdOpt);
+		}
+
+		if (!parse_fit_method(fitCmdOpt, analysisParams.blockMatching.fit)) {
+			THROW_EXCEPTION("Unknown fit: " + (std::string)fitCmdOpt);
+		}
+
+		if (analysisParams.maxFeatures < 1) {
+			THROW_EXCEPTION("max_features should be positive");
+		}
+
+		if (analysisParams.motionSource != "pixels" && analysisParams.motionSource != "codec_mv" && analysisParams.motionSource != "hybrid" && analysisParams.motionSource != "gyro") {
+			THROW_EXCEPTION("Unknown motion source: " + analysisParams.motionSource);
+		}
+
+		const std::string gyroAxes = gyroAxesCmdOpt;
+		std::array<int, 3> axes;
+		std::array<double, 3> signs;
+		if (!gyroAxes.empty() && !parse_gyro_axes(gyroAxes, axes, signs)) {
+			THROW_EXCEPTION("Invalid gyro_axes: " + gyroAxes);
+		}
+
+		if (analysisParams.gyroFov <= 0 || analysisParams.gyroFov >= std::numbers::pi) {
+			THROW_EXCEPTION("gyro_fov should be between 0 and 180 degrees");
+		}
+
+		if (analysisParams.gyroFusion && analysisParams.motionSource != "gyro") {
+			LOGW << "gyro_fusion needs motion_source gyro, switching to it";
+			analysisParams.motionSource = "gyro";
+		}
+
+		// Options only some detectors support. With --detector it must support all the given ones, without it
+		// the first detector that does is used, c4 if no such option is given.
+		struct DetectorOption {
+			std::string name;
+			bool given;
+			std::vector<std::string> detectors;
+		};
+		const std::vector<DetectorOption> detectorOptions {
+			{ "log_polar", analysisParams.logPolar, { "phasecorr" } },
+			{ "motion_source " + analysisParams.motionSource, analysisParams.motionSource == "codec_mv" || analysisParams.motionSource == "hybrid", { "blocks" } },
+			// Gyro motion goes through MotionSmoother, any other detector can correct it
+			{ "motion_source gyro", analysisParams.motionSource == "gyro", { "blocks", "phasecorr", "features" } },
+			{ "adaptive_downscale", analysisParams.adaptiveFactor > 1, { "blocks", "phasecorr", "features" } },
+			{ "fit", analysisParams.blockMatching.fit != FitMethod::trimmed, { "blocks", "features" } },
+			{ "search", analysisParams.blockMatching.search != SearchStrategy::exhaustive, { "blocks" } },
+			{ "temporal_prediction", analysisParams.blockMatching.temporalPrediction, { "blocks" } },
+			{ "min_texture", analysisParams.blockMatching.minTexture > 0, { "blocks" } },
+			{ "max_blocks", analysisParams.blockMatching.maxBlocks > 0, { "blocks" } },
+			{ "pyramid_levels", analysisParams.blockMatching.pyramidLevels > 1, { "blocks" } },
+		};
+
+		const std::string detector = detectorCmdOpt;
+		if (!detector.empty() && detector != "c4" && detector != "blocks" && detector != "phasecorr" && detector != "features") {
+			THROW_EXCEPTION("Unknown detector: " + detector);
+		}
+
+		std::vector<std::string> candidates{ "blocks", "phasecorr", "features" };
+		std::string givenOptions;
+		for (const DetectorOption& option : detectorOptions) {
+			if (!option.given) {
+				continue;
+			}
+			if (!detector.empty() && std::find(option.detectors.begin(), option.detectors.end(), detector) == option.detectors.end()) {
+				THROW_EXCEPTION(option.name + " can't be used with the " + detector + " detector");
+			}
+			std::erase_if(candidates, [&](const std::string& d) { return std::find(option.detectors.begin(), option.detectors.end(), d) == option.detectors.end(); });
+			givenOptions += (givenOptions.empty() ? "" : ", ") + option.name;
+		}
+
+		if (!detector.empty()) {
+			analysisParams.detector = detector;
+		} else if (givenOptions.empty()) {
+			analysisParams.detector = "c4";
+		} else if (candidates.empty()) {
+			THROW_EXCEPTION("No detector supports all of " + givenOptions);
+		} else {
+			analysisParams.detector = candidates.front();
+			LOGW << "Using the " << analysisParams.detector << " detector for " << givenOptions;
+		}
+
+		if (analysisParams.blockMatching.pyramidLevels < 1 || analysisParams.blockMatching.refineRadius < 1 || analysisParams.blockMatching.minSearchRadius < 1) {
+			THROW_EXCEPTION("pyramid_levels, refine_radius and min_search_radius should be positive");
+		}
+
 		std::vector<std::string> ignore = ignoreCmdOpt;
 
 		std::vector<c4::rectangle<int>> ignoreRects;
@@ -583,22 +1881,105 @@ int main(int argc, char* argv[]) {
 
 		c4::image_dumper::getInstance().init("", false);
 
-		FfmpegVideoProcessor videoProcessor(inputFilename, outputFilename, bitrate, codecCmdOpt);
+		const std::string proxyIn = proxyInCmdOpt;
+		const std::string proxyOut = proxyOutCmdOpt;
+
+		const std::string analysisInput = analysisInputCmdOpt;
+
+		// Motion vectors are needed from the decoder of the video motion is detected on
+		const bool codecMotion = analysisParams.motionSource == "codec_mv" || analysisParams.motionSource == "hybrid";
+		if (codecMotion && !proxyIn.empty()) {
+			THROW_EXCEPTION("motion_source " + analysisParams.motionSource + " can't be used with proxy_in, the proxy has no motion vectors");
+		}
+
+		const bool gyroMotion = analysisParams.motionSource == "gyro";
+		if (gyroMotion && (!proxyIn.empty() || !analysisInput.empty())) {
+			THROW_EXCEPTION("motion_source gyro can't be used with proxy_in or analysis_input, the gyro track is matched to the input frames");
+		}
+
+		FfmpegVideoProcessor videoProcessor(inputFilename, outputFilename, bitrate, codecCmdOpt, codecMotion && analysisInput.empty(), outputSize, outputPixFmt, previewCmdOpt, previewCmdOpt && (!proxyIn.empty() || !analysisInput.empty()));
 
 		const auto frameSize = videoProcessor.get_frame_size();
 
-		const int downscale = downscaleCmdOpt > 0 ? (int)downscaleCmdOpt : 1 + frameSize.min() / 1000;
+		if (!proxyIn.empty() && proxyIn == proxyOut) {
+			THROW_EXCEPTION("proxy_in and proxy_out can't be the same file");
+		}
+
+		if (!proxyIn.empty() && !analysisInput.empty()) {
+			THROW_EXCEPTION("proxy_in and analysis_input can't be used together");
+		}
+
+		std::unique_ptr<AnalysisProxyReader> proxyReader;
+		if (!proxyIn.empty()) {
+			proxyReader = std::make_unique<AnalysisProxyReader>(proxyIn);
+			const auto proxySourceSize = proxyReader->source_size();
+			if (proxySourceSize.width != frameSize.width || proxySourceSize.height != frameSize.height) {
+				THROW_EXCEPTION("Analysis proxy was made from a video of different size: " + proxyIn);
+			}
+		}
+
+		std::unique_ptr<FfmpegVideoReader> analysisReader;
+		c4::matrix_dimensions analysisSize = frameSize;
+		if (!analysisInput.empty()) {
+			analysisReader = std::make_unique<FfmpegVideoReader>(analysisInput, codecMotion);
+			analysisSize = analysisReader->get_frame_size();
+			PRINT_DEBUG(analysisSize.width);
+			PRINT_DEBUG(analysisSize.height);
+
+			const double frameAspect = (double)frameSize.width / frameSize.height;
+			const double analysisAspect = (double)analysisSize.width / analysisSize.height;
+			if (std::abs(frameAspect / analysisAspect - 1) > 0.01) {
+				LOGW << "Analysis input aspect ratio doesn't match the input: " << analysisSize.width << "x" << analysisSize.height << " vs " << frameSize.width << "x" << frameSize.height;
+			}
+		}
+
+		int downscale = downscaleCmdOpt > 0 ? (int)downscaleCmdOpt : 1 + analysisSize.min() / 1000;
+		if (proxyReader) {
+			if (downscaleCmdOpt > 0 && downscaleCmdOpt != proxyReader->downscale()) {
+				LOGW << "Ignoring downscale " << (int)downscaleCmdOpt << ", analysis proxy was made with downscale " << proxyReader->downscale();
+			}
+			downscale = proxyReader->downscale();
+			analysisSize = c4::matrix_dimensions{ .height = proxyReader->height() * downscale, .width = proxyReader->width() * downscale };
+		}
 
 		PRINT_DEBUG(downscale);
 
-		VidStabProcessor frameProcessor(params, frameSize.width, frameSize.height, downscale, ignoreRects, prezoomCmdOpt, autozoomCmdOpt, zoomSpeedCmdOpt, debugImprintCmdOpt);
+		VidStabProcessor frameProcessor(params, analysisParams, frameSize.width, frameSize.height, analysisSize, downscale, ignoreRects, prezoomCmdOpt, autozoomCmdOpt, zoomSpeedCmdOpt, debugImprintCmdOpt, ditherCmdOpt, passthroughThresholdCmdOpt, previewCmdOpt ? WarpInterpolation::nearest : WarpInterpolation::bilinear);
+
+		if (proxyReader) {
+			frameProcessor.set_proxy_input(std::move(proxyReader));
+		}
+		if (analysisReader) {
+			frameProcessor.set_analysis_input(std::move(analysisReader));
+		}
+		if (!proxyOut.empty()) {
+			frameProcessor.set_proxy_output(proxyOut);
+		}
+		if (gyroMotion) {
+			std::unique_ptr<GyroMotion> gyro = read_gyro(inputFilename, gyroAxes);
+			if (gyro->empty()) {
+				THROW_EXCEPTION("No gyro data found in " + inputFilename);
+			}
+			LOGD << "Gyro track of " << gyro->duration() << " s";
+			frameProcessor.set_gyro_input(std::move(gyro));
+		}
 
 		if (autozoomCmdOpt) {
-			videoProcessor.process(frameProcessor, true);
+			if (!analysisInput.empty()) {
+				frameProcessor.preprocess_analysis_input();
+			} else if (!proxyIn.empty()) {
+				frameProcessor.preprocess_proxy();
+			} else {
+				videoProcessor.process(frameProcessor, true);
+			}
 			frameProcessor.optimize_zoom();
-			videoProcessor.init_input();
+			if (frameProcessor.analyzes_source()) {
+				videoProcessor.init_input();
+			}
 		}
 		videoProcessor.process(frameProcessor, false);
+		frameProcessor.check_proxy_length();
+		frameProcessor.print_stats();
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
     }
@@ -0,0 +1,459 @@
+//MIT License
+//
+//Copyright(c) 2025 Alex Kasitskyi
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files(the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions :
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <string>
+#include <limits>
+#include <vector>
+#include <numbers>
+#include <iomanip>
+#include <iostream>
+
+#include "block_matching.hpp"
+#include "motion_estimation.hpp"
+#include "warp.hpp"
+#include "gyro_motion.hpp"
+
+// Microbenchmarks for the hot kernels, each SIMD variant is checked against the scalar one.
+// Also checks reads and writes of interleaved components, and GyroMotion on synthesized GPMF metadata.
+
+struct GrayImage {
+	int width;
+	int height;
+	std::vector<uint8_t> data;
+
+	GrayImage(int width, int height, unsigned seed) : width(width), height(height), data(width * height) {
+		std::mt19937 rng(seed);
+		for (uint8_t& v : data) {
+			v = uint8_t(rng());
+		}
+	}
+};
+
+// Full search of a maxShift window for every block of a grid, like BlockMotionDetector does
+static int64_t block_search(SadFunction sad, const GrayImage& a, const GrayImage& b, int blockSize, int maxShift) {
+	int64_t checksum = 0;
+	for (int y = maxShift; y + blockSize + maxShift <= a.height; y += blockSize) {
+		for (int x = maxShift; x + blockSize + maxShift <= a.width; x += blockSize) {
+			int best = std::numeric_limits<int>::max();
+			for (int dy = -maxShift; dy <= maxShift; dy++) {
+				for (int dx = -maxShift; dx <= maxShift; dx++) {
+					best = std::min(best, sad(a.data.data() + y * a.width + x, a.width, b.data.data() + (y + dy) * b.width + x + dx, b.width));
+				}
+			}
+			checksum += best;
+		}
+	}
+	return checksum;
+}
+
+static int bench_sad() {
+	// 4K frame at the default downscale of 5
+	const GrayImage a(768, 432, 1);
+	const GrayImage b(768, 432, 2);
+	const int maxShift = 16;
+
+	int ret = 0;
+	std::cout << "SAD block search, " << a.width << "x" << a.height << ", max shift " << maxShift << std::endl;
+	for (int blockSize : { 16, 32, 48, 64 }) {
+		int64_t reference = 0;
+		double scalarTime = 0;
+		for (const SadKernel& kernel : sad_kernels(blockSize)) {
+			int64_t checksum = 0;
+			double time = std::numeric_limits<double>::max();
+			for (int k = 0; k < 5; k++) {
+				const auto start = std::chrono::steady_clock::now();
+				checksum = block_search(kernel.function, a, b, blockSize, maxShift);
+				time = std::min(time, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+			}
+
+			if (kernel.isa == "scalar") {
+				reference = checksum;
+				scalarTime = time;
+			}
+
+			const bool ok = checksum == reference;
+			std::cout << "  block " << std::setw(2) << blockSize << " " << std::setw(7) << kernel.isa << ": " << std::fixed << std::setprecision(2) << std::setw(8) << time << " ms, x" << scalarTime / time << (ok ? "" : "  MISMATCH") << std::endl;
+			if (!ok) {
+				ret = -1;
+			}
+		}
+	}
+	return ret;
+}
+
+// Early exit kernels must be exact below the limit and reach the limit otherwise
+static int check_sad_limit() {
+	const GrayImage a(256, 256, 3);
+	const GrayImage b(256, 256, 4);
+
+	int ret = 0;
+	for (int blockSize : { 16, 32, 48, 64 }) {
+		const SadLimitFunction f = best_sad_limit_function(blockSize);
+		bool ok = true;
+		for (int k = 0; k < 64; k++) {
+			const uint8_t* pa = a.data.data() + (k * 3) * a.width + k * 2;
+			const uint8_t* pb = b.data.data() + (k * 2) * b.width + k * 3;
+			const int exact = sad_scalar(pa, a.width, pb, b.width, blockSize);
+			const int limit = exact * (k % 4) / 2;
+			const int s = f(pa, a.width, pb, b.width, limit);
+			ok &= exact < limit ? s == exact : s >= limit && s <= exact;
+			ok &= f(pa, a.width, pb, b.width, std::numeric_limits<int>::max()) == exact;
+		}
+		std::cout << "SAD with early exit, block " << std::setw(2) << blockSize << ": " << (ok ? "ok" : "MISMATCH") << std::endl;
+		if (!ok) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+// Luma plane box downscale as done for motion detection, specialized kernels against the generic scalar one
+static int bench_downscale() {
+	struct Case {
+		const char* name;
+		int width;
+		int height;
+		int bytesPerSample;
+		int bits;
+		int factor;
+	};
+
+	int ret = 0;
+	std::cout << "Luma downscale" << std::endl;
+	for (const Case& c : { Case{ "4K 8 bit", 3840, 2160, 1, 8, 3 }, Case{ "4K 10 bit", 3840, 2160, 2, 10, 3 }, Case{ "4K P010", 3840, 2160, 2, 16, 3 }, Case{ "8K 8 bit", 7680, 4320, 1, 8, 5 } }) {
+		const int stride = c.width * c.bytesPerSample;
+		std::vector<uint8_t> src(size_t(stride) * c.height);
+		std::mt19937 rng(5);
+		for (size_t i = 0; i < src.size(); i += c.bytesPerSample) {
+			const uint32_t v = rng() & ((1u << c.bits) - 1);
+			src[i] = uint8_t(v);
+			if (c.bytesPerSample == 2) {
+				src[i + 1] = uint8_t(v >> 8);
+			}
+		}
+
+		const int dstWidth = c.width / c.factor;
+		const int dstHeight = c.height / c.factor;
+		std::vector<uint8_t> reference(size_t(dstWidth) * dstHeight);
+		std::vector<uint8_t> dst(reference.size());
+
+		const DownscaleLumaFunction generic = c.bytesPerSample == 1 ? downscale_luma_scalar<uint8_t, 0> : downscale_luma_scalar<uint16_t, 0>;
+		const DownscaleLumaFunction kernel = downscale_luma_function(c.bytesPerSample, c.factor);
+
+		auto time = [&](DownscaleLumaFunction f, std::vector<uint8_t>& out) {
+			double best = std::numeric_limits<double>::max();
+			for (int k = 0; k < 5; k++) {
+				const auto start = std::chrono::steady_clock::now();
+				f(src.data(), stride, out.data(), dstWidth, dstHeight, dstWidth, c.factor, c.bits);
+				best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+			}
+			return best;
+		};
+
+		const double genericTime = time(generic, reference);
+		const double kernelTime = time(kernel, dst);
+		const bool ok = dst == reference;
+		std::cout << "  " << std::setw(9) << c.name << " /" << c.factor << ": generic " << std::fixed << std::setprecision(2) << std::setw(7) << genericTime << " ms, " << cpu_isa_name(cpu_isa()) << " " << std::setw(7) << kernelTime << " ms, x" << genericTime / kernelTime << (ok ? "" : "  MISMATCH") << std::endl;
+		if (!ok) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+// Frame warp by the motion, the c4 implementation against the fixed point kernels of its transform class.
+// Kernels must match the scalar one exactly, the difference to c4 is only printed.
+template<class T>
+static int bench_warp_plane(const char* name, int width, int height, int bits, const c4::MotionDetector::Motion& motion) {
+	c4::matrix<T> src(height, width);
+	std::mt19937 rng(6);
+	for (int i = 0; i < height; i++) {
+		for (int j = 0; j < width; j++) {
+			src[i][j] = T(((i + j) * 3 + rng() % 32) & ((1 << bits) - 1));
+		}
+	}
+
+	auto time = [&](auto f) {
+		double best = std::numeric_limits<double>::max();
+		for (int k = 0; k < 3; k++) {
+			const auto start = std::chrono::steady_clock::now();
+			f();
+			best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		}
+		return best;
+	};
+
+	c4::matrix<T> c4dst(height, width);
+	const double c4Time = time([&] { motion.apply(src, c4dst); });
+	std::cout << "  " << std::setw(10) << name << ": " << std::setw(7) << "c4" << " " << std::fixed << std::setprecision(2) << std::setw(8) << c4Time << " ms" << std::endl;
+
+	int ret = 0;
+	c4::matrix<T> reference(height, width);
+	const bool translation = warp_transform(motion) == WarpTransform::translation;
+	const auto versions = translation ? warp_kernel_versions<T, WarpInterpolation::bilinear, WarpTransform::translation>() : warp_kernel_versions<T, WarpInterpolation::bilinear, WarpTransform::general>();
+	for (const WarpKernelVersion& kernel : versions) {
+		c4::matrix<T> dst(height, width);
+		const double kernelTime = time([&] {
+			if (translation) {
+				warp_shift(motion, src, dst, kernel.kernels);
+			} else {
+				warp_plane(motion, src, dst, kernel.kernels);
+			}
+		});
+		if (kernel.isa == "scalar") {
+			reference = dst;
+		}
+
+		bool ok = true;
+		int c4Diff = 0;
+		for (int i = 0; i < height; i++) {
+			for (int j = 0; j < width; j++) {
+				ok &= dst[i][j] == reference[i][j];
+				c4Diff = std::max(c4Diff, std::abs(int(dst[i][j]) - int(c4dst[i][j])));
+			}
+		}
+
+		std::cout << "  " << std::setw(10) << name << ": " << std::setw(7) << kernel.isa << " " << std::setw(8) << kernelTime << " ms, x" << c4Time / kernelTime << ", max diff to c4 " << c4Diff << (ok ? "" : "  MISMATCH") << std::endl;
+		if (!ok) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static int bench_warp() {
+	c4::MotionDetector::Motion similarity;
+	similarity.shift = c4::point<double>(3.3, -2.7);
+	similarity.alpha = 0.01;
+	similarity.scale = 1.02;
+
+	c4::MotionDetector::Motion translation;
+	translation.shift = c4::point<double>(3.3, -2.7);
+
+	int ret = 0;
+	for (const auto& [transform, motion] : { std::pair("rotation and zoom", similarity), std::pair("translation", translation) }) {
+		std::cout << "Bilinear warp of a luma plane, " << transform << std::endl;
+		ret |= bench_warp_plane<uint8_t>("1080p 8", 1920, 1080, 8, motion);
+		ret |= bench_warp_plane<uint16_t>("1080p 10", 1920, 1080, 10, motion);
+		ret |= bench_warp_plane<uint8_t>("4K 8", 3840, 2160, 8, motion);
+		ret |= bench_warp_plane<uint16_t>("4K 10", 3840, 2160, 10, motion);
+		ret |= bench_warp_plane<uint8_t>("8K 8", 7680, 4320, 8, motion);
+		ret |= bench_warp_plane<uint16_t>("8K 16", 7680, 4320, 16, motion);
+	}
+	return ret;
+}
+
+// Interleaved layouts as process() reads and writes them: NV12 and P010 chroma, packed RGB, YUYV.
+// Components written from planes must land in their bytes only, read back unchanged, and fills must set them.
+struct InterleavedComponent {
+	int offset;
+	int step;
+	int width;
+};
+
+template<class T>
+static bool check_interleaved(int shift, int depth, int rowBytes, const std::vector<InterleavedComponent>& components) {
+	const int height = 7;
+	const int linesize = rowBytes + 5;
+	std::mt19937 rng(6);
+
+	// Bytes no component covers keep their value
+	std::vector<uint8_t> data(size_t(linesize) * height);
+	for (uint8_t& v : data) {
+		v = uint8_t(rng());
+	}
+	std::vector<uint8_t> expected = data;
+
+	bool ok = true;
+	std::vector<c4::matrix<T>> planes;
+	for (const InterleavedComponent& c : components) {
+		c4::matrix<T> plane(height, c.width);
+		for (int i = 0; i < height; i++) {
+			for (int j = 0; j < c.width; j++) {
+				const T v = T(rng() & ((1u << depth) - 1));
+				plane[i][j] = v;
+				const uint32_t stored = uint32_t(v) << shift;
+				for (int b = 0; b < (int)sizeof(T); b++) {
+					expected[size_t(i) * linesize + c.offset + j * c.step + b] = uint8_t(stored >> (8 * b));
+				}
+			}
+		}
+		write_component<T>(plane, data.data() + c.offset, linesize, c.step, shift);
+		planes.push_back(std::move(plane));
+	}
+	ok &= data == expected;
+
+	for (size_t k = 0; k < components.size(); k++) {
+		const InterleavedComponent& c = components[k];
+		c4::matrix<T> plane(height, c.width);
+		read_component<T>(data.data() + c.offset, linesize, c.step, shift, plane);
+		for (int i = 0; i < height; i++) {
+			ok &= std::equal(plane[i], plane[i] + c.width, planes[k][i]);
+		}
+	}
+
+	// Opaque alpha, or any value, into the last component
+	const InterleavedComponent& last = components.back();
+	const T value = T((1u << depth) - 1);
+	fill_component<T>(data.data() + last.offset, linesize, last.step, shift, height, last.width, value);
+	for (int i = 0; i < height; i++) {
+		for (int j = 0; j < last.width; j++) {
+			const uint32_t stored = uint32_t(value) << shift;
+			for (int b = 0; b < (int)sizeof(T); b++) {
+				expected[size_t(i) * linesize + last.offset + j * last.step + b] = uint8_t(stored >> (8 * b));
+			}
+		}
+	}
+	ok &= data == expected;
+
+	return ok;
+}
+
+static int check_component_io() {
+	const int w = 13;
+	bool ok = true;
+	ok &= check_interleaved<uint8_t>(0, 8, 2 * w, { { 0, 2, w }, { 1, 2, w } });
+	ok &= check_interleaved<uint16_t>(6, 10, 4 * w, { { 0, 4, w }, { 2, 4, w } });
+	ok &= check_interleaved<uint16_t>(0, 10, 4 * w, { { 0, 4, w }, { 2, 4, w } });
+	ok &= check_interleaved<uint8_t>(0, 8, 3 * w, { { 0, 3, w }, { 1, 3, w }, { 2, 3, w } });
+	ok &= check_interleaved<uint8_t>(0, 8, 4 * w, { { 0, 4, w }, { 1, 4, w }, { 2, 4, w }, { 3, 4, w } });
+	ok &= check_interleaved<uint8_t>(0, 8, 4 * w, { { 0, 2, 2 * w }, { 1, 4, w }, { 3, 4, w } });
+	ok &= check_interleaved<uint16_t>(0, 16, 8 * w, { { 0, 8, w }, { 2, 8, w }, { 4, 8, w }, { 6, 8, w } });
+
+	std::cout << "Interleaved component read, write and fill: " << (ok ? "ok" : "MISMATCH") << std::endl;
+	return ok ? 0 : -1;
+}
+
+// GPMF KLV item: key, type, sample size and count, data padded to 4 bytes. Values are big-endian.
+static std::vector<uint8_t> gpmf_klv(const char* key, char type, int sampleSize, int repeat, const std::vector<uint8_t>& data) {
+	std::vector<uint8_t> klv(key, key + 4);
+	klv.push_back(uint8_t(type));
+	klv.push_back(uint8_t(sampleSize));
+	klv.push_back(uint8_t(repeat >> 8));
+	klv.push_back(uint8_t(repeat));
+	klv.insert(klv.end(), data.begin(), data.end());
+	klv.resize((klv.size() + 3) & ~size_t(3));
+	return klv;
+}
+
+static std::vector<uint8_t> gpmf_int16(const std::vector<int>& values) {
+	std::vector<uint8_t> data;
+	for (int v : values) {
+		data.push_back(uint8_t(v >> 8));
+		data.push_back(uint8_t(v));
+	}
+	return data;
+}
+
+// One second DEVC payload: an ACCL stream to be skipped, then a GYRO stream of 200 identical samples
+static std::vector<uint8_t> gpmf_payload(const std::string& orientation, const std::vector<int>& scale, const std::vector<int>& sample) {
+	const int samples = 200;
+	std::vector<int> values;
+	for (int i = 0; i < samples; i++) {
+		values.insert(values.end(), sample.begin(), sample.end());
+	}
+
+	std::vector<uint8_t> gyro;
+	for (const std::vector<uint8_t>& item : { gpmf_klv("SCAL", 's', 2, (int)scale.size(), gpmf_int16(scale)), gpmf_klv("ORIN", 'c', 3, 1, std::vector<uint8_t>(orientation.begin(), orientation.end())), gpmf_klv("GYRO", 's', 6, samples, gpmf_int16(values)) }) {
+		gyro.insert(gyro.end(), item.begin(), item.end());
+	}
+
+	const std::vector<uint8_t> accl = gpmf_klv("ACCL", 's', 6, 1, gpmf_int16({ 1, 2, 3 }));
+	std::vector<uint8_t> devc = gpmf_klv("STRM", 0, 1, (int)accl.size(), accl);
+	const std::vector<uint8_t> strm = gpmf_klv("STRM", 0, 1, (int)gyro.size(), gyro);
+	devc.insert(devc.end(), strm.begin(), strm.end());
+	return gpmf_klv("DEVC", 0, 1, (int)devc.size(), devc);
+}
+
+// Gyro metadata parsing, axes mapping, integration and the signs of the image motion. The camera turns right at
+// 0.5 rad/s (around Y, which points down), down at 0.2 rad/s (around X, to the right) and clockwise at 0.1 rad/s
+// (around Z, the optical axis).
+static int check_gyro() {
+	GyroMotion gyro;
+	// Channels Z, X, Y with one scale
+	const std::vector<uint8_t> first = gpmf_payload("ZXY", { 1000 }, { 100, -200, 500 });
+	gyro.add_payload(first.data(), first.size(), 0., 1.);
+	// Channels Y, -Z, X with a scale per channel
+	const std::vector<uint8_t> second = gpmf_payload("YzX", { 500, 2000, 1000 }, { 250, -200, -200 });
+	gyro.add_payload(second.data(), second.size(), 1., 1.);
+	// Turning back after a half second gap without samples
+	const std::vector<uint8_t> third = gpmf_payload("ZXY", { 1000 }, { -100, 200, -500 });
+	gyro.add_payload(third.data(), third.size(), 2.5, 1.);
+
+	const int width = 1000;
+	const int height = 500;
+	const double fov = std::numbers::pi / 2;
+	const double focal = width / 2.;
+
+	struct Case {
+		double t0;
+		double t1;
+		// Rotation of the camera around X, Y and Z in between
+		double x;
+		double y;
+		double z;
+	};
+
+	bool ok = std::abs(gyro.duration() - 3.5) < 1e-9;
+	for (const Case& c : { Case{ 0.1, 0.2, -0.02, 0.05, 0.01 }, Case{ 0.9, 1.1, -0.04, 0.1, 0.02 }, Case{ 1.5, 1.6, -0.02, 0.05, 0.01 }, Case{ 1.9, 2.7, 0.02, -0.05, -0.01 }, Case{ 3., 3.1, 0.02, -0.05, -0.01 } }) {
+		c4::MotionDetector::Motion motion;
+		if (!gyro.motion(c.t0, c.t1, width, height, fov, motion)) {
+			ok = false;
+			continue;
+		}
+		// The image moves against the camera: left when it turns right, up when it turns down
+		ok &= std::abs(motion.shift.x + focal * std::tan(c.y)) < 1e-6;
+		ok &= std::abs(motion.shift.y - focal * std::tan(c.x)) < 1e-6;
+		ok &= std::abs(motion.alpha + c.z) < 1e-9;
+		ok &= motion.scale == 1. && motion.confidence == 1.;
+	}
+
+	c4::MotionDetector::Motion motion;
+	ok &= !gyro.motion(3.4, 3.6, width, height, fov, motion);
+
+	// Overriding the axes takes the channels of the first payload as X, Y, Z
+	GyroMotion overridden("XYZ");
+	overridden.add_payload(first.data(), first.size(), 0., 1.);
+	ok &= overridden.motion(0.1, 0.2, width, height, fov, motion) && std::abs(motion.shift.x + focal * std::tan(-0.02)) < 1e-6 && std::abs(motion.shift.y - focal * std::tan(0.01)) < 1e-6 && std::abs(motion.alpha + 0.05) < 1e-9;
+
+	std::array<int, 3> axes;
+	std::array<double, 3> signs;
+	ok &= parse_gyro_axes("yXz", axes, signs) && axes == std::array<int, 3>{ 1, 0, 2 } && signs == std::array<double, 3>{ -1., 1., -1. };
+	ok &= !parse_gyro_axes("XXY", axes, signs) && !parse_gyro_axes("XY", axes, signs) && !parse_gyro_axes("XYW", axes, signs);
+
+	std::cout << "Gyro metadata: " << (ok ? "ok" : "MISMATCH") << std::endl;
+	return ok ? 0 : -1;
+}
+
+int main(int argc, char* argv[]) {
+	const int sadRet = bench_sad();
+	const int limitRet = check_sad_limit();
+	const int downscaleRet = bench_downscale();
+	const int warpRet = bench_warp();
+	const int componentRet = check_component_io();
+	const int gyroRet = check_gyro();
+	return sadRet ? sadRet : limitRet ? limitRet : downscaleRet ? downscaleRet : warpRet ? warpRet : componentRet ? componentRet : gyroRet;
+}
@@ -26,9 +26,9 @@
 #include <iostream>
 #include <filesystem>
 
-int test(const std::string& exe, const std::string& fin) {
+int test(const std::string& exe, const std::string& fin, const std::string& args = "") {
 	const std::string fout = "tmp.mp4";
-	std::string cmd = exe + " " + fin + " " + fout + " --debug";
+	std::string cmd = exe + " " + fin + " " + fout + " --debug " + args;
 
 	int ret = std::system(cmd.c_str());
 	if(ret == 0) {
@@ -79,5 +79,54 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
-	return 0;
+	const std::string proxy = "tmp.ffsp";
+
+	// Runs are done in order, later ones can use files produced by earlier ones
+	const std::vector<std::pair<std::string, std::string>> optionTests {
+		{ "h246_720p_60fps.mp4", "--proxy_out " + proxy },
+		{ "h246_720p_60fps.mp4", "--proxy_in " + proxy + " --autozoom" },
+		{ "h264_1080p_30fps_a.mp4", "--analysis_input ../test_data/h264_1080p_30fps_a.mp4" },
+		{ "h264_1080p_30fps_a.mp4", "--analysis_input ../test_data/h264_1080p_30fps_a.mp4 --autozoom" },
+		{ "hevc_720p_60fps_10bit.mp4", "--detector blocks" },
+		{ "h264_4k_30fps.mp4", "--adaptive_downscale 2 --autozoom" },
+		{ "h264_4k_30fps.mp4", "--pyramid_levels 3 --downscale 2" },
+		{ "h264_1080p_30fps_a.mp4", "--search hexagon" },
+		{ "h264_1080p_30fps_a.mp4", "--detector blocks --detector_cut_threshold 0.2" },
+		{ "h246_720p_60fps.mp4", "--search sea --autozoom" },
+		{ "h264_1080p_30fps_a.mp4", "--temporal_prediction --adaptive_downscale 2" },
+		{ "h264_1080p_30fps_a.mp4", "--motion_source codec_mv" },
+		{ "h246_720p_60fps.mp4", "--motion_source codec_mv" },
+		{ "h246_720p_60fps.mp4", "--analysis_input ../test_data/h264_1080p_30fps_a.mp4 --motion_source codec_mv" },
+		{ "h264_720p_60fps_gyro.mp4", "--motion_source gyro" },
+		{ "h264_720p_60fps_gyro.mp4", "--gyro_fusion --autozoom" },
+		{ "h246_720p_60fps.mp4", "--motion_source hybrid --autozoom" },
+		{ "hevc_1080p_30fps_10bit_444_a.mp4", "--min_texture 4 --max_blocks 40" },
+		{ "h264_1080p_30fps_a.mp4", "--fit ransac --max_alpha 0.3 --max_scale 1.2" },
+		{ "h246_720p_60fps.mp4", "--fit irls" },
+		{ "h264_1080p_30fps_a.mp4", "--detector phasecorr" },
+		{ "h246_720p_60fps.mp4", "--detector phasecorr --log_polar --autozoom" },
+		{ "h264_4k_30fps.mp4", "--detector features --downscale 2" },
+		{ "h264_4k_30fps.mp4", "--output_size 1920x1080" },
+		{ "hevc_720p_60fps_10bit_422.mp4", "--output_size 1000x600 --autozoom" },
+		{ "hevc_720p_60fps_10bit_422.mp4", "--output_pix_fmt yuv420p --dither" },
+		{ "h264_1080p_30fps_a.mp4", "--codec libx264 --output_pix_fmt nv12" },
+		{ "hevc_720p_60fps_10bit_422.mp4", "--codec libx264 --output_pix_fmt nv20le --autozoom" },
+		{ "h264_1080p_30fps_a.mp4", "--passthrough_threshold 0.5 --max_alpha 0 --max_scale 1" },
+		{ "h264_4k_30fps.mp4", "--preview --autozoom" },
+		{ "h246_720p_60fps.mp4", "--proxy_in " + proxy + " --preview" },
+	};
+
+	int ret = 0;
+	for (const auto& [file, args] : optionTests) {
+		std::cout << "Processing " << file << " " << args << std::endl;
+		if (test(exe, "../test_data/" + file, args)) {
+			std::cerr << "Test failed for " << file << " " << args << std::endl;
+			ret = -1;
+			break;
+		}
+	}
+
+	std::remove(proxy.c_str());
+
+	return ret;
 }
@@ -0,0 +1,283 @@
+//MIT License
+//
+//Copyright(c) 2025 Alex Kasitskyi
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files(the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions :
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <c4/video_stabilization.hpp>
+
+// Camera motion from gyroscope samples stored in the container, like GoPro GPMF metadata streams.
+// Angular velocity is integrated between frame timestamps, and the rotation is mapped to image motion
+// with a pinhole camera model: rotation around the optical axis is the motion angle, and rotation around
+// the other two axes shifts the image by focal length times the tangent of the angle.
+// Camera axes are X to the right, Y down and Z forward (the optical axis).
+
+// Maps channels of a sample to camera axes. Letter i names the camera axis of channel i, lowercase ones are
+// negated, e.g. "ZXY" or "yXz". Returns false if it isn't a permutation of the axes.
+inline bool parse_gyro_axes(const std::string& s, std::array<int, 3>& axes, std::array<double, 3>& signs) {
+	if (s.size() != 3) {
+		return false;
+	}
+	bool used[3] = {};
+	for (int i = 0; i < 3; i++) {
+		const char c = s[i];
+		const int axis = c >= 'x' ? c - 'x' : c - 'X';
+		if (axis < 0 || axis > 2 || used[axis]) {
+			return false;
+		}
+		used[axis] = true;
+		axes[i] = axis;
+		signs[i] = c >= 'x' ? -1. : 1.;
+	}
+	return true;
+}
+
+class GyroMotion {
+	typedef std::array<double, 3> Vec3;
+
+	// Integrated rotation (radians) at sample boundaries, angular velocity is constant between them
+	std::vector<double> times;
+	std::vector<Vec3> angles;
+
+	// Axes of the stream, overrides ORIN
+	const std::string axesOverride;
+
+	// GPMF is KLV with big-endian values: four character key, type, size of one sample and sample count.
+	// Type 0 is a nested container, data is padded to 4 bytes.
+	struct Klv {
+		char key[4];
+		char type;
+		int sampleSize;
+		int repeat;
+		const uint8_t* data;
+
+		int size() const {
+			return sampleSize * repeat;
+		}
+
+		bool is(const char* k) const {
+			return std::memcmp(key, k, 4) == 0;
+		}
+	};
+
+	static int type_size(char type) {
+		switch (type) {
+		case 'b': case 'B': case 'c': return 1;
+		case 's': case 'S': return 2;
+		case 'l': case 'L': case 'f': return 4;
+		case 'd': case 'j': case 'J': return 8;
+		default: return 0;
+		}
+	}
+
+	static uint64_t read_be(const uint8_t* p, int bytes) {
+		uint64_t v = 0;
+		for (int i = 0; i < bytes; i++) {
+			v = (v << 8) | p[i];
+		}
+		return v;
+	}
+
+	// Value of a numeric type, 0 for unsupported ones
+	static double read_value(char type, const uint8_t* p) {
+		const uint64_t v = read_be(p, type_size(type));
+		switch (type) {
+		case 'b': return (int8_t)v;
+		case 'B': return (uint8_t)v;
+		case 's': return (int16_t)v;
+		case 'S': return (uint16_t)v;
+		case 'l': return (int32_t)v;
+		case 'L': return (uint32_t)v;
+		case 'j': return (double)(int64_t)v;
+		case 'J': return (double)v;
+		case 'f': {
+			const uint32_t u = (uint32_t)v;
+			float f;
+			std::memcpy(&f, &u, sizeof(f));
+			return f;
+		}
+		case 'd': {
+			double d;
+			std::memcpy(&d, &v, sizeof(d));
+			return d;
+		}
+		default: return 0;
+		}
+	}
+
+	template<class F>
+	static void for_each_klv(const uint8_t* data, size_t size, F f) {
+		size_t pos = 0;
+		while (pos + 8 <= size) {
+			Klv klv;
+			std::memcpy(klv.key, data + pos, 4);
+			klv.type = (char)data[pos + 4];
+			klv.sampleSize = data[pos + 5];
+			klv.repeat = (int)read_be(data + pos + 6, 2);
+			klv.data = data + pos + 8;
+
+			const size_t padded = (klv.size() + 3) & ~size_t(3);
+			if (pos + 8 + padded > size) {
+				return;
+			}
+			f(klv);
+			pos += 8 + padded;
+		}
+	}
+
+	// GYRO samples of all streams in the payload, in rad/s and camera axes
+	void parse_streams(const uint8_t* data, size_t size, std::vector<Vec3>& samples) const {
+		for_each_klv(data, size, [&](const Klv& klv) {
+			if (klv.type != 0) {
+				return;
+			}
+			if (klv.is("DEVC")) {
+				parse_streams(klv.data, klv.size(), samples);
+				return;
+			}
+			if (!klv.is("STRM")) {
+				return;
+			}
+
+			// Sticky properties of the stream precede its samples
+			std::vector<double> scale{ 1. };
+			std::string orientation = "ZXY";
+			for_each_klv(klv.data, klv.size(), [&](const Klv& item) {
+				const int bytes = type_size(item.type);
+				if (item.is("SCAL") && bytes > 0) {
+					scale.clear();
+					for (int i = 0; i < item.size() / bytes; i++) {
+						scale.push_back(read_value(item.type, item.data + i * bytes));
+					}
+				} else if (item.is("ORIN") && item.type == 'c' && item.size() >= 3) {
+					orientation.assign((const char*)item.data, 3);
+				} else if (item.is("GYRO") && bytes > 0 && item.sampleSize == 3 * bytes) {
+					std::array<int, 3> axes;
+					std::array<double, 3> signs;
+					if (!parse_gyro_axes(axesOverride.empty() ? orientation : axesOverride, axes, signs)) {
+						return;
+					}
+					for (int i = 0; i < item.repeat; i++) {
+						Vec3 v{};
+						for (int c = 0; c < 3; c++) {
+							const double s = scale[std::min<size_t>(c, scale.size() - 1)];
+							v[axes[c]] = signs[c] * read_value(item.type, item.data + i * item.sampleSize + c * bytes) / (s != 0 ? s : 1.);
+						}
+						samples.push_back(v);
+					}
+				}
+			});
+		});
+	}
+
+	bool angle_at(double t, Vec3& angle) const {
+		if (times.size() < 2 || t < times.front() || t > times.back()) {
+			return false;
+		}
+		const size_t i = std::min<size_t>(std::upper_bound(times.begin(), times.end(), t) - times.begin(), times.size() - 1);
+		const double w = times[i] > times[i - 1] ? (t - times[i - 1]) / (times[i] - times[i - 1]) : 1.;
+		for (int c = 0; c < 3; c++) {
+			angle[c] = angles[i - 1][c] + w * (angles[i][c] - angles[i - 1][c]);
+		}
+		return true;
+	}
+
+public:
+	// axes overrides the channel order of the streams, see parse_gyro_axes()
+	explicit GyroMotion(const std::string& axes = "") : axesOverride(axes) {}
+
+	// GPMF payload covering duration seconds from start, samples are spread evenly over it.
+	// Payloads should come in time order, as they are stored in the stream.
+	void add_payload(const uint8_t* data, size_t size, double start, double duration) {
+		std::vector<Vec3> samples;
+		parse_streams(data, size, samples);
+		if (samples.empty() || !(duration > 0)) {
+			return;
+		}
+
+		// Gaps between payloads are taken as no rotation
+		if (times.empty() || start > times.back()) {
+			times.push_back(start);
+			angles.push_back(angles.empty() ? Vec3{} : angles.back());
+		}
+
+		const double end = start + duration;
+		const double step = (end - times.back()) / samples.size();
+		if (!(step > 0)) {
+			return;
+		}
+		for (const Vec3& v : samples) {
+			Vec3 angle = angles.back();
+			for (int c = 0; c < 3; c++) {
+				angle[c] += v[c] * step;
+			}
+			times.push_back(times.back() + step);
+			angles.push_back(angle);
+		}
+	}
+
+	bool empty() const {
+		return times.size() < 2;
+	}
+
+	double duration() const {
+		return empty() ? 0. : times.back() - times.front();
+	}
+
+	// Motion of the image from time t0 to t1 for a width x height frame with the horizontal field of view fov (radians).
+	// Returns false if the gyro track doesn't cover both times.
+	bool motion(double t0, double t1, int width, int height, double fov, c4::MotionDetector::Motion& motion) const {
+		Vec3 a0;
+		Vec3 a1;
+		if (!angle_at(t0, a0) || !angle_at(t1, a1)) {
+			return false;
+		}
+
+		// Rotating the camera by theta moves a point P of the scene by -theta x P in camera coordinates
+		const double focal = width / 2. / std::tan(fov / 2);
+		motion = c4::MotionDetector::Motion();
+		motion.shift.x = -focal * std::tan(a1[1] - a0[1]);
+		motion.shift.y = focal * std::tan(a1[0] - a0[0]);
+		motion.alpha = -(a1[2] - a0[2]);
+		motion.confidence = 1.;
+		return true;
+	}
+};
+
+// Gyro motion corrected by the image based one where the image is reliable. The gyro can't see zoom and drifts
+// slightly over time, while the image based estimate fails on textureless and fast moving frames. Rotation around
+// the optical axis is left to the gyro, which measures it directly.
+inline c4::MotionDetector::Motion fuse_motion(const c4::MotionDetector::Motion& gyro, const c4::MotionDetector::Motion& image) {
+	const double w = std::clamp(image.confidence, 0., 1.);
+	c4::MotionDetector::Motion m = gyro;
+	m.shift.x = w * image.shift.x + (1 - w) * gyro.shift.x;
+	m.shift.y = w * image.shift.y + (1 - w) * gyro.shift.y;
+	m.scale = std::pow(image.scale, w);
+	m.confidence = std::max(gyro.confidence, image.confidence);
+	return m;
+}
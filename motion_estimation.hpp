@@ -0,0 +1,1143 @@
+//MIT License
+//
+//Copyright(c) 2025 Alex Kasitskyi
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files(the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions :
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+
+#include <c4/video_stabilization.hpp>
+
+#include "cpu_dispatch.hpp"
+#include "block_matching.hpp"
+
+// Frame to frame motion estimation done in ffstabilize itself, as opposed to c4::VideoStabilization
+// which only exposes the final smoothed correction.
+//
+// Raw motions use c4::MotionDetector::Motion with this convention: a point p of the previous frame
+// is found at center + scale * rotate(p - center, alpha) + shift in the next frame.
+
+FFSTAB_INLINE void downscale_box_impl(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor) {
+	const int area = factor * factor;
+	std::vector<int> acc(dstWidth);
+
+	for (int i = 0; i < dstHeight; i++) {
+		std::fill(acc.begin(), acc.end(), 0);
+		for (int k = 0; k < factor; k++) {
+			const uint8_t* s = src + (i * factor + k) * srcStride;
+			for (int j = 0; j < dstWidth; j++) {
+				for (int l = 0; l < factor; l++) {
+					acc[j] += s[j * factor + l];
+				}
+			}
+		}
+		uint8_t* d = dst + i * dstStride;
+		for (int j = 0; j < dstWidth; j++) {
+			d[j] = uint8_t((acc[j] + area / 2) / area);
+		}
+	}
+}
+
+typedef void (*DownscaleBoxFunction)(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor);
+
+inline void downscale_box_scalar(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor) {
+	downscale_box_impl(src, srcStride, dst, dstStride, dstHeight, dstWidth, factor);
+}
+
+#ifdef FFSTAB_TARGET_CLONES
+FFSTAB_TARGET_AVX2 inline void downscale_box_avx2(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor) {
+	downscale_box_impl(src, srcStride, dst, dstStride, dstHeight, dstWidth, factor);
+}
+
+FFSTAB_TARGET_AVX512 inline void downscale_box_avx512(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor) {
+	downscale_box_impl(src, srcStride, dst, dstStride, dstHeight, dstWidth, factor);
+}
+#endif
+
+// Box downscale of a gray frame by an integer factor
+inline c4::VideoStabilization::FramePtr downscale_box(const c4::VideoStabilization::Frame& src, int factor) {
+	static const DownscaleBoxFunction kernel = select_kernel<DownscaleBoxFunction>(downscale_box_scalar, FFSTAB_CLONE(downscale_box_avx2), FFSTAB_CLONE(downscale_box_avx512));
+
+	c4::VideoStabilization::FramePtr dst = std::make_shared<c4::VideoStabilization::Frame>();
+	dst->resize(src.height() / factor, src.width() / factor);
+
+	kernel(src.data(), src.stride(), dst->data(), dst->stride(), dst->height(), dst->width(), factor);
+
+	return dst;
+}
+
+// Box average of a luma plane by an integer factor, into 8 bits. Samples are uint8_t or uint16_t with the value
+// in the low bits bits, so e.g. 10 bit samples stored in the high bits (P010) are read with bits = 16.
+// Factor 0 means the factor is taken from the argument, the others are unrolled.
+template<class T, int Factor>
+FFSTAB_INLINE void downscale_luma_impl(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor, int bits) {
+	const int f = Factor ? Factor : factor;
+	const int area = f * f;
+	const int shift = bits - 8;
+	const uint32_t round = (uint32_t(area) << shift) / 2;
+	const int width = dstWidth * f;
+
+	// Columns are summed over the rows of a block first, that loop is contiguous and vectorizes well.
+	// 8 bit sums of up to 257 rows fit into 16 bits.
+	typedef std::conditional_t<sizeof(T) == 1, uint16_t, uint32_t> Sum;
+	std::vector<Sum> columns(width);
+
+	for (int i = 0; i < dstHeight; i++) {
+		const T* s = (const T*)(src + size_t(i * f) * srcStride);
+		for (int x = 0; x < width; x++) {
+			columns[x] = s[x];
+		}
+		for (int k = 1; k < f; k++) {
+			s = (const T*)(src + size_t(i * f + k) * srcStride);
+			for (int x = 0; x < width; x++) {
+				columns[x] += s[x];
+			}
+		}
+
+		// floor(floor(x / a) / 2^s) == floor(x / (a * 2^s)), and the division by a constant area is cheap
+		uint8_t* d = dst + i * dstStride;
+		for (int j = 0; j < dstWidth; j++) {
+			uint32_t sum = 0;
+			for (int l = 0; l < f; l++) {
+				sum += columns[j * f + l];
+			}
+			d[j] = uint8_t(std::min<uint32_t>(((sum + round) / area) >> shift, 255));
+		}
+	}
+}
+
+typedef void (*DownscaleLumaFunction)(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor, int bits);
+
+template<class T, int Factor>
+void downscale_luma_scalar(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor, int bits) {
+	downscale_luma_impl<T, Factor>(src, srcStride, dst, dstStride, dstHeight, dstWidth, factor, bits);
+}
+
+#ifdef FFSTAB_TARGET_CLONES
+template<class T, int Factor>
+FFSTAB_TARGET_AVX2 void downscale_luma_avx2(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor, int bits) {
+	downscale_luma_impl<T, Factor>(src, srcStride, dst, dstStride, dstHeight, dstWidth, factor, bits);
+}
+
+template<class T, int Factor>
+FFSTAB_TARGET_AVX512 void downscale_luma_avx512(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int dstHeight, int dstWidth, int factor, int bits) {
+	downscale_luma_impl<T, Factor>(src, srcStride, dst, dstStride, dstHeight, dstWidth, factor, bits);
+}
+#endif
+
+template<class T, int Factor>
+DownscaleLumaFunction select_downscale_luma() {
+	return select_kernel<DownscaleLumaFunction>(downscale_luma_scalar<T, Factor>, FFSTAB_CLONE(downscale_luma_avx2<T, Factor>), FFSTAB_CLONE(downscale_luma_avx512<T, Factor>));
+}
+
+template<class T>
+DownscaleLumaFunction select_downscale_luma(int factor) {
+	switch (factor) {
+	case 1: return select_downscale_luma<T, 1>();
+	case 2: return select_downscale_luma<T, 2>();
+	case 3: return select_downscale_luma<T, 3>();
+	case 4: return select_downscale_luma<T, 4>();
+	case 5: return select_downscale_luma<T, 5>();
+	case 6: return select_downscale_luma<T, 6>();
+	default: return select_downscale_luma<T, 0>();
+	}
+}
+
+// Kernel for 1 or 2 byte samples, specialized for the factors automatic downscale picks
+inline DownscaleLumaFunction downscale_luma_function(int bytesPerSample, int factor) {
+	return bytesPerSample == 1 ? select_downscale_luma<uint8_t>(factor) : select_downscale_luma<uint16_t>(factor);
+}
+
+inline std::vector<c4::rectangle<int>> downscale_rects(const std::vector<c4::rectangle<int>>& rects, int factor) {
+	std::vector<c4::rectangle<int>> scaled;
+	for (const c4::rectangle<int>& r : rects) {
+		scaled.emplace_back(r.x / factor, r.y / factor, r.w / factor, r.h / factor);
+	}
+	return scaled;
+}
+
+// Displacement of one block between two frames, in the previous frame coordinates
+struct BlockMatch {
+	c4::point<double> pos;
+	c4::point<double> shift;
+	double weight = 0;
+};
+
+// Point p moved by the motion, see the convention at the top
+inline c4::point<double> move_point(const c4::MotionDetector::Motion& motion, const c4::point<double>& p, const c4::point<double>& center) {
+	const double a = motion.scale * std::cos(motion.alpha);
+	const double b = motion.scale * std::sin(motion.alpha);
+	const double qx = p.x - center.x;
+	const double qy = p.y - center.y;
+	return c4::point<double>(center.x + a * qx - b * qy + motion.shift.x, center.y + b * qx + a * qy + motion.shift.y);
+}
+
+// Motion that applies first, then second
+inline c4::MotionDetector::Motion compose_motion(const c4::MotionDetector::Motion& second, const c4::MotionDetector::Motion& first) {
+	c4::MotionDetector::Motion m;
+	m.scale = second.scale * first.scale;
+	m.alpha = second.alpha + first.alpha;
+	const double a = second.scale * std::cos(second.alpha);
+	const double b = second.scale * std::sin(second.alpha);
+	m.shift = c4::point<double>(a * first.shift.x - b * first.shift.y + second.shift.x, b * first.shift.x + a * first.shift.y + second.shift.y);
+	m.confidence = std::min(second.confidence, first.confidence);
+	return m;
+}
+
+// Motion d such that compose_motion(d, first) == total
+inline c4::MotionDetector::Motion motion_difference(const c4::MotionDetector::Motion& total, const c4::MotionDetector::Motion& first) {
+	c4::MotionDetector::Motion m;
+	m.scale = total.scale / first.scale;
+	m.alpha = total.alpha - first.alpha;
+	const double a = m.scale * std::cos(m.alpha);
+	const double b = m.scale * std::sin(m.alpha);
+	m.shift = c4::point<double>(total.shift.x - (a * first.shift.x - b * first.shift.y), total.shift.y - (b * first.shift.x + a * first.shift.y));
+	m.confidence = total.confidence;
+	return m;
+}
+
+enum class FitMethod {
+	// Matches far from the fit, relative to the median error, are dropped and the fit is repeated
+	trimmed,
+	// Iteratively reweighted least squares with Tukey's biweight, starting from a median based estimate
+	irls,
+	// Best consensus of similarities through two random matches, refined by least squares on its inliers
+	ransac
+};
+
+inline const char* fit_method_name(FitMethod method) {
+	switch (method) {
+	case FitMethod::irls: return "irls";
+	case FitMethod::ransac: return "ransac";
+	default: return "trimmed";
+	}
+}
+
+inline bool parse_fit_method(const std::string& name, FitMethod& method) {
+	for (FitMethod m : { FitMethod::trimmed, FitMethod::irls, FitMethod::ransac }) {
+		if (name == fit_method_name(m)) {
+			method = m;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Weighted least squares fit of shift, scale and rotation around the frame center to block matches,
+// with outlier rejection. The fit is closed form, so its cost doesn't depend on maxAlpha and maxScale,
+// which only clamp the result.
+class SimilarityFit {
+	const double maxAlpha;
+	const double maxScale;
+	const FitMethod method;
+
+	static double sqr(double x) {
+		return x * x;
+	}
+
+	// Least squares with per match multipliers of the match weights, 0 excludes a match
+	c4::MotionDetector::Motion fit(const std::vector<BlockMatch>& matches, const std::vector<double>& robustWeights, const c4::point<double>& center) const {
+		double sw = 0;
+		c4::point<double> mq;
+		c4::point<double> mr;
+		for (size_t i = 0; i < matches.size(); i++) {
+			const BlockMatch& m = matches[i];
+			const double w = m.weight * robustWeights[i];
+			if (w <= 0) {
+				continue;
+			}
+			sw += w;
+			mq.x += w * (m.pos.x - center.x);
+			mq.y += w * (m.pos.y - center.y);
+			mr.x += w * (m.pos.x + m.shift.x - center.x);
+			mr.y += w * (m.pos.y + m.shift.y - center.y);
+		}
+
+		c4::MotionDetector::Motion motion;
+		if (sw <= 0) {
+			return motion;
+		}
+
+		mq *= 1. / sw;
+		mr *= 1. / sw;
+
+		double sqq = 0;
+		double sdot = 0;
+		double scross = 0;
+		for (size_t i = 0; i < matches.size(); i++) {
+			const BlockMatch& m = matches[i];
+			const double w = m.weight * robustWeights[i];
+			if (w <= 0) {
+				continue;
+			}
+			const double qx = m.pos.x - center.x - mq.x;
+			const double qy = m.pos.y - center.y - mq.y;
+			const double rx = m.pos.x + m.shift.x - center.x - mr.x;
+			const double ry = m.pos.y + m.shift.y - center.y - mr.y;
+			sqq += w * (qx * qx + qy * qy);
+			sdot += w * (qx * rx + qy * ry);
+			scross += w * (qx * ry - qy * rx);
+		}
+
+		double a = 1.;
+		double b = 0.;
+		if (sqq > 1e-9) {
+			a = sdot / sqq;
+			b = scross / sqq;
+		}
+
+		motion.scale = std::clamp(std::sqrt(a * a + b * b), 1. / maxScale, maxScale);
+		motion.alpha = std::clamp(std::atan2(b, a), -maxAlpha, maxAlpha);
+
+		a = motion.scale * std::cos(motion.alpha);
+		b = motion.scale * std::sin(motion.alpha);
+		motion.shift.x = mr.x - (a * mq.x - b * mq.y);
+		motion.shift.y = mr.y - (b * mq.x + a * mq.y);
+
+		return motion;
+	}
+
+	static c4::point<double> residual(const c4::MotionDetector::Motion& motion, const BlockMatch& m, const c4::point<double>& center) {
+		const c4::point<double> moved = move_point(motion, m.pos, center);
+		return c4::point<double>(moved.x - (m.pos.x + m.shift.x), moved.y - (m.pos.y + m.shift.y));
+	}
+
+	static std::vector<double> errors(const c4::MotionDetector::Motion& motion, const std::vector<BlockMatch>& matches, const c4::point<double>& center) {
+		std::vector<double> e;
+		for (const BlockMatch& m : matches) {
+			const c4::point<double> r = residual(motion, m, center);
+			e.push_back(std::sqrt(sqr(r.x) + sqr(r.y)));
+		}
+		return e;
+	}
+
+	static double median(std::vector<double> v) {
+		std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+		return v[v.size() / 2];
+	}
+
+	// Matches within this distance of the fit count as inliers
+	static double inlier_threshold(const std::vector<double>& e) {
+		return std::max(1., 2.5 * median(e));
+	}
+
+	// Similarity mapping q1 to r1 and q2 to r2, false if the points coincide
+	static bool similarity(const BlockMatch& m1, const BlockMatch& m2, const c4::point<double>& center, c4::MotionDetector::Motion& motion) {
+		const double qx = m2.pos.x - m1.pos.x;
+		const double qy = m2.pos.y - m1.pos.y;
+		const double rx = m2.pos.x + m2.shift.x - m1.pos.x - m1.shift.x;
+		const double ry = m2.pos.y + m2.shift.y - m1.pos.y - m1.shift.y;
+		const double qq = qx * qx + qy * qy;
+		if (qq < 1e-9) {
+			return false;
+		}
+
+		// (a + ib) = r / q as complex numbers
+		const double a = (qx * rx + qy * ry) / qq;
+		const double b = (qx * ry - qy * rx) / qq;
+		motion.scale = std::sqrt(a * a + b * b);
+		motion.alpha = std::atan2(b, a);
+		const double px = m1.pos.x - center.x;
+		const double py = m1.pos.y - center.y;
+		motion.shift.x = m1.pos.x + m1.shift.x - center.x - (a * px - b * py);
+		motion.shift.y = m1.pos.y + m1.shift.y - center.y - (b * px + a * py);
+		return true;
+	}
+
+	c4::MotionDetector::Motion fit_trimmed(const std::vector<BlockMatch>& matches, const c4::point<double>& center) const {
+		std::vector<double> robustWeights(matches.size(), 1.);
+		c4::MotionDetector::Motion motion = fit(matches, robustWeights, center);
+
+		for (int iter = 0; iter < 2; iter++) {
+			const std::vector<double> e = errors(motion, matches, center);
+			const double threshold = inlier_threshold(e);
+			for (size_t i = 0; i < matches.size(); i++) {
+				robustWeights[i] = e[i] <= threshold;
+			}
+			motion = fit(matches, robustWeights, center);
+		}
+
+		return motion;
+	}
+
+	c4::MotionDetector::Motion fit_irls(const std::vector<BlockMatch>& matches, const c4::point<double>& center) const {
+		// Start from medians of pairwise estimates rather than least squares, so a large group of outliers can't pull the start
+		// towards itself. Pairs are random, so pairs mixing an outlier and an inlier scatter around the true motion.
+		std::minstd_rand rng(matches.size());
+		std::uniform_int_distribution<size_t> pick(0, matches.size() - 1);
+		std::vector<double> as;
+		std::vector<double> bs;
+		for (size_t k = 0; k < 2 * matches.size(); k++) {
+			c4::MotionDetector::Motion pair;
+			const size_t i = pick(rng);
+			const size_t j = pick(rng);
+			if (i != j && similarity(matches[i], matches[j], center, pair)) {
+				as.push_back(pair.scale * std::cos(pair.alpha));
+				bs.push_back(pair.scale * std::sin(pair.alpha));
+			}
+		}
+		const double a = as.empty() ? 1. : median(as);
+		const double b = bs.empty() ? 0. : median(bs);
+
+		std::vector<double> xs;
+		std::vector<double> ys;
+		for (const BlockMatch& m : matches) {
+			const double qx = m.pos.x - center.x;
+			const double qy = m.pos.y - center.y;
+			xs.push_back(m.pos.x + m.shift.x - center.x - (a * qx - b * qy));
+			ys.push_back(m.pos.y + m.shift.y - center.y - (b * qx + a * qy));
+		}
+		c4::MotionDetector::Motion motion;
+		motion.scale = std::sqrt(a * a + b * b);
+		motion.alpha = std::atan2(b, a);
+		motion.shift.x = median(xs);
+		motion.shift.y = median(ys);
+
+		std::vector<double> robustWeights(matches.size(), 1.);
+		for (int iter = 0; iter < 8; iter++) {
+			const std::vector<double> e = errors(motion, matches, center);
+			// Robust sigma from the median error, with a floor for sub-pixel noise
+			const double c = 4.685 * std::max(0.5, 1.4826 * median(e));
+			for (size_t i = 0; i < matches.size(); i++) {
+				robustWeights[i] = e[i] < c ? sqr(1. - sqr(e[i] / c)) : 0.;
+			}
+			motion = fit(matches, robustWeights, center);
+		}
+
+		return motion;
+	}
+
+	c4::MotionDetector::Motion fit_ransac(const std::vector<BlockMatch>& matches, const c4::point<double>& center) const {
+		constexpr double threshold = 1.5;
+		constexpr double successProbability = 0.999;
+		constexpr int maxIterations = 256;
+
+		// Fixed seed, so results are reproducible
+		std::minstd_rand rng(matches.size());
+		std::uniform_int_distribution<size_t> pick(0, matches.size() - 1);
+
+		double totalWeight = 0;
+		for (const BlockMatch& m : matches) {
+			totalWeight += m.weight;
+		}
+
+		std::vector<double> robustWeights(matches.size(), 1.);
+		double bestScore = -1;
+		int iterations = maxIterations;
+		for (int iter = 0; iter < iterations && matches.size() >= 2; iter++) {
+			const size_t i = pick(rng);
+			const size_t j = pick(rng);
+			c4::MotionDetector::Motion hypothesis;
+			if (i == j || !similarity(matches[i], matches[j], center, hypothesis)) {
+				continue;
+			}
+
+			double score = 0;
+			for (const BlockMatch& m : matches) {
+				const c4::point<double> r = residual(hypothesis, m, center);
+				if (sqr(r.x) + sqr(r.y) <= sqr(threshold)) {
+					score += m.weight;
+				}
+			}
+
+			if (score > bestScore) {
+				bestScore = score;
+				for (size_t k = 0; k < matches.size(); k++) {
+					const c4::point<double> r = residual(hypothesis, matches[k], center);
+					robustWeights[k] = sqr(r.x) + sqr(r.y) <= sqr(threshold);
+				}
+
+				// Enough iterations to draw two inliers at least once with successProbability
+				const double inlierShare = totalWeight > 0 ? std::clamp(score / totalWeight, 0.01, 0.999) : 0.01;
+				iterations = std::min(maxIterations, (int)std::ceil(std::log(1 - successProbability) / std::log(1 - sqr(inlierShare))));
+			}
+		}
+
+		c4::MotionDetector::Motion motion = fit(matches, robustWeights, center);
+
+		// Least squares refinement on the inliers of the refined motion
+		const std::vector<double> e = errors(motion, matches, center);
+		for (size_t k = 0; k < matches.size(); k++) {
+			robustWeights[k] = e[k] <= threshold;
+		}
+		return fit(matches, robustWeights, center);
+	}
+
+public:
+	SimilarityFit(double maxAlpha, double maxScale, FitMethod method = FitMethod::trimmed) : maxAlpha(maxAlpha), maxScale(maxScale), method(method) {}
+
+	// Confidence is the weight of the inliers relative to the number of matches
+	c4::MotionDetector::Motion operator()(const std::vector<BlockMatch>& matches, const c4::point<double>& center) const {
+		if (matches.empty()) {
+			return c4::MotionDetector::Motion();
+		}
+
+		c4::MotionDetector::Motion motion;
+		switch (method) {
+		case FitMethod::irls:
+			motion = fit_irls(matches, center);
+			break;
+		case FitMethod::ransac:
+			motion = fit_ransac(matches, center);
+			break;
+		default:
+			motion = fit_trimmed(matches, center);
+			break;
+		}
+
+		const std::vector<double> e = errors(motion, matches, center);
+		const double threshold = inlier_threshold(e);
+		double inlierWeight = 0;
+		for (size_t i = 0; i < matches.size(); i++) {
+			if (e[i] <= threshold) {
+				inlierWeight += matches[i].weight;
+			}
+		}
+		motion.confidence = inlierWeight / matches.size();
+
+		return motion;
+	}
+};
+
+enum class SearchStrategy {
+	// Every shift of the window
+	exhaustive,
+	// Large diamond pattern steps followed by a small diamond refinement
+	diamond,
+	// Hexagon pattern steps followed by a small diamond refinement
+	hexagon,
+	// Every shift of the window, but shifts that can't beat the best one by the block sum bound are skipped,
+	// and SADs that exceed the best one are stopped early. Finds the same shift as exhaustive, ties included.
+	successive_elimination
+};
+
+inline const char* search_strategy_name(SearchStrategy strategy) {
+	switch (strategy) {
+	case SearchStrategy::diamond: return "diamond";
+	case SearchStrategy::hexagon: return "hexagon";
+	case SearchStrategy::successive_elimination: return "sea";
+	default: return "exhaustive";
+	}
+}
+
+inline bool parse_search_strategy(const std::string& name, SearchStrategy& strategy) {
+	for (SearchStrategy s : { SearchStrategy::exhaustive, SearchStrategy::diamond, SearchStrategy::hexagon, SearchStrategy::successive_elimination }) {
+		if (name == search_strategy_name(s)) {
+			strategy = s;
+			return true;
+		}
+	}
+	return false;
+}
+
+struct BlockMatchingParams {
+	SearchStrategy search = SearchStrategy::exhaustive;
+	// Image pyramid levels. Motion found on the coarsest level is refined on the finer ones, 1 means a single level search.
+	int pyramidLevels = 1;
+	// Search radius on the finer pyramid levels, around the position predicted by the coarser level
+	int refineRadius = 2;
+	// Center the search on the previous frame motion, and shrink the window while the confidence stays high
+	bool temporalPrediction = false;
+	// Smallest search radius temporal prediction shrinks the window to
+	int minSearchRadius = 4;
+	// Blocks with lower pixel standard deviation are not matched, 0 matches all blocks
+	double minTexture = 0;
+	// Only this many most textured blocks are matched, 0 means no limit
+	int maxBlocks = 0;
+	// Outlier rejection of the motion fit to the block shifts
+	FitMethod fit = FitMethod::trimmed;
+};
+
+// SAD block matching on a regular grid of blocks, followed by SimilarityFit.
+// With pyramidLevels > 1 the full maxShift search is done on the coarsest level only, so the largest
+// detectable motion grows 2x per level, while finer levels cost a small refineRadius search.
+class BlockMotionDetector {
+	const int blockSize;
+	const int maxShift;
+	const BlockMatchingParams matchingParams;
+	const SimilarityFit similarityFit;
+	const SadFunction sadFunction;
+	const SadLimitFunction sadLimitFunction;
+
+	std::vector<int> sads;
+
+	int sad(const uint8_t* a, int aStride, const uint8_t* b, int bStride) const {
+		return sadFunction ? sadFunction(a, aStride, b, bStride) : sad_scalar(a, aStride, b, bStride, blockSize);
+	}
+
+	static bool intersects(const c4::rectangle<int>& r, int x, int y, int size) {
+		return x < r.x + r.w && r.x < x + size && y < r.y + r.h && r.y < y + size;
+	}
+
+	// Parabola vertex through three equally spaced samples
+	static double subpixel(int l, int c, int r) {
+		const int d = l + r - 2 * c;
+		return d > 0 ? 0.5 * (l - r) / d : 0.;
+	}
+
+	// Search window of the current block, SADs are cached as patterns revisit shifts, -1 means not computed
+	const uint8_t* blockPrev = nullptr;
+	int prevStride = 0;
+	const uint8_t* windowCenter = nullptr;
+	int nextStride = 0;
+	int radius = 0;
+	int side = 0;
+
+	int blockX = 0;
+	int blockY = 0;
+	int windowX = 0;
+	int windowY = 0;
+
+	// Integral images for successive elimination and texture. Sums wrap around, but differences of them are still exact
+	// as long as a block sum fits into the type.
+	std::vector<uint32_t> prevIntegral;
+	std::vector<uint32_t> nextIntegral;
+	std::vector<uint64_t> prevSquaresIntegral;
+	int integralStride = 0;
+
+	// Start candidates for pattern searches and successive elimination, relative to the window center
+	std::vector<std::array<int, 2>> searchStarts;
+
+	int64_t sadEvaluations = 0;
+	int64_t searchedBlocks = 0;
+	int64_t texturelessBlocks = 0;
+
+	// Temporal prediction state, predictionWidth is the width of the frame prediction was found on, 0 if there's none
+	static constexpr double reliableConfidence = 0.3;
+	const double sceneCutThreshold;
+	c4::MotionDetector::Motion prediction;
+	int predictionWidth = 0;
+	int predictionRadius;
+
+	template<class T, bool Squares>
+	void integrate(const c4::VideoStabilization::Frame& frame, std::vector<T>& integral) {
+		integralStride = frame.width() + 1;
+		integral.assign(size_t(frame.height() + 1) * integralStride, 0);
+		for (int i = 0; i < frame.height(); i++) {
+			const uint8_t* row = frame.data() + i * frame.stride();
+			T rowSum = 0;
+			for (int j = 0; j < frame.width(); j++) {
+				rowSum += Squares ? T(row[j]) * row[j] : T(row[j]);
+				integral[size_t(i + 1) * integralStride + j + 1] = integral[size_t(i) * integralStride + j + 1] + rowSum;
+			}
+		}
+	}
+
+	template<class T>
+	T box_sum(const std::vector<T>& integral, int x, int y) const {
+		const T* top = integral.data() + size_t(y) * integralStride + x;
+		const T* bottom = top + size_t(blockSize) * integralStride;
+		return bottom[blockSize] - bottom[0] - top[blockSize] + top[0];
+	}
+
+	// Standard deviation of the prev frame block pixels
+	double texture(int x, int y) const {
+		const double n = double(blockSize) * blockSize;
+		const double mean = box_sum(prevIntegral, x, y) / n;
+		return std::sqrt(std::max(0., box_sum(prevSquaresIntegral, x, y) / n - mean * mean));
+	}
+
+	int& cached(int dx, int dy) {
+		return sads[(dy + radius) * side + dx + radius];
+	}
+
+	// Exact SAD of the current block at shift (dx, dy) from the window center
+	int cost(int dx, int dy) {
+		int& s = cached(dx, dy);
+		if (s < 0) {
+			s = sad(blockPrev, prevStride, windowCenter + dy * nextStride + dx, nextStride);
+			sadEvaluations++;
+		}
+		return s;
+	}
+
+	// Tie break of shifts with equal SADs: the one closest to zero, then the first in raster order.
+	// It's a total order, so searches that visit shifts in different orders agree on the best one.
+	static bool preferred(int dx, int dy, int bestDx, int bestDy) {
+		const int d = std::abs(dx) + std::abs(dy);
+		const int bestD = std::abs(bestDx) + std::abs(bestDy);
+		return d < bestD || (d == bestD && (dy < bestDy || (dy == bestDy && dx < bestDx)));
+	}
+
+	void search_exhaustive(int& bestDx, int& bestDy) {
+		int best = std::numeric_limits<int>::max();
+		for (int dy = -radius; dy <= radius; dy++) {
+			for (int dx = -radius; dx <= radius; dx++) {
+				const int s = cost(dx, dy);
+				if (s < best || (s == best && preferred(dx, dy, bestDx, bestDy))) {
+					best = s;
+					bestDx = dx;
+					bestDy = dy;
+				}
+			}
+		}
+	}
+
+	// Steps to the best point of the large pattern until the center wins, then once with the small pattern
+	template<size_t LargeSize>
+	void search_pattern(const std::array<std::array<int, 2>, LargeSize>& large, int& bestDx, int& bestDy) {
+		static constexpr std::array<std::array<int, 2>, 4> small{ { { 0, -1 }, { -1, 0 }, { 1, 0 }, { 0, 1 } } };
+
+		auto step = [&](const auto& pattern) {
+			const int cx = bestDx;
+			const int cy = bestDy;
+			int best = cost(cx, cy);
+			for (const std::array<int, 2>& o : pattern) {
+				const int dx = cx + o[0];
+				const int dy = cy + o[1];
+				if (std::abs(dx) > radius || std::abs(dy) > radius) {
+					continue;
+				}
+				const int s = cost(dx, dy);
+				if (s < best) {
+					best = s;
+					bestDx = dx;
+					bestDy = dy;
+				}
+			}
+			return bestDx != cx || bestDy != cy;
+		};
+
+		// Starts from the best of zero shift and the shifts found for the neighbor blocks
+		bestDx = bestDy = 0;
+		for (const std::array<int, 2>& start : searchStarts) {
+			if (std::abs(start[0]) <= radius && std::abs(start[1]) <= radius && cost(start[0], start[1]) < cost(bestDx, bestDy)) {
+				bestDx = start[0];
+				bestDy = start[1];
+			}
+		}
+
+		for (int i = 0; i < side && step(large); i++) {
+		}
+		step(small);
+	}
+
+	void search_successive_elimination(int& bestDx, int& bestDy) {
+		const uint32_t blockSum = box_sum(prevIntegral, blockX, blockY);
+
+		// A good first guess makes both the bound and the early exit reject more
+		bestDx = bestDy = 0;
+		int best = cost(0, 0);
+		for (const std::array<int, 2>& start : searchStarts) {
+			if (std::abs(start[0]) <= radius && std::abs(start[1]) <= radius && cost(start[0], start[1]) < best) {
+				best = cost(start[0], start[1]);
+				bestDx = start[0];
+				bestDy = start[1];
+			}
+		}
+
+		// Shifts that tie with the best one have to be evaluated exactly too, for the tie break of search_exhaustive():
+		// the bound only skips shifts that are worse, and the early exit only stops SADs that are over best
+		for (int dy = -radius; dy <= radius; dy++) {
+			for (int dx = -radius; dx <= radius; dx++) {
+				int s = cached(dx, dy);
+				if (s < 0) {
+					// |sum(a) - sum(b)| <= sum(|a - b|)
+					const int bound = std::abs(int(blockSum - box_sum(nextIntegral, windowX + dx, windowY + dy)));
+					if (bound > best) {
+						continue;
+					}
+					const uint8_t* b = windowCenter + dy * nextStride + dx;
+					s = sadLimitFunction ? sadLimitFunction(blockPrev, prevStride, b, nextStride, best + 1) : sad(blockPrev, prevStride, b, nextStride);
+					sadEvaluations++;
+					if (s > best) {
+						continue;
+					}
+					cached(dx, dy) = s;
+				}
+				if (s < best || (s == best && preferred(dx, dy, bestDx, bestDy))) {
+					best = s;
+					bestDx = dx;
+					bestDy = dy;
+				}
+			}
+		}
+	}
+
+	// Typical SAD of a wrong shift, so that the match weight doesn't depend on the block contrast: the mean of a ring
+	// of shifts at half the radius from the best one. Every search strategy uses the same ring, so they give the same
+	// weights when they find the same shift.
+	double mean_sad(int bestDx, int bestDy) {
+		const int d = std::max(radius / 2, 1);
+		int64_t total = 0;
+		int count = 0;
+		for (int oy = -1; oy <= 1; oy++) {
+			for (int ox = -1; ox <= 1; ox++) {
+				const int dx = std::clamp(bestDx + ox * d, -radius, radius);
+				const int dy = std::clamp(bestDy + oy * d, -radius, radius);
+				if (dx != bestDx || dy != bestDy) {
+					total += cost(dx, dy);
+					count++;
+				}
+			}
+		}
+		return count ? double(total) / count : 0.;
+	}
+
+	// Searches shifts within radius around (px, py) for the block at (x, y)
+	bool match_block(const c4::VideoStabilization::Frame& prev, const c4::VideoStabilization::Frame& next, int x, int y, int px, int py, int searchRadius, BlockMatch& match) {
+		radius = searchRadius;
+		side = 2 * radius + 1;
+		sads.assign(side * side, -1);
+
+		blockPrev = prev.data() + y * prev.stride() + x;
+		prevStride = prev.stride();
+		windowCenter = next.data() + (y + py) * next.stride() + x + px;
+		nextStride = next.stride();
+		blockX = x;
+		blockY = y;
+		windowX = x + px;
+		windowY = y + py;
+
+		searchedBlocks++;
+
+		int bestDx = 0;
+		int bestDy = 0;
+		// Pattern searches don't pay off on small windows
+		const SearchStrategy strategy = radius <= 2 && matchingParams.search != SearchStrategy::successive_elimination ? SearchStrategy::exhaustive : matchingParams.search;
+		switch (strategy) {
+		case SearchStrategy::exhaustive:
+			search_exhaustive(bestDx, bestDy);
+			break;
+		case SearchStrategy::diamond:
+			search_pattern(std::array<std::array<int, 2>, 8>{ { { 0, -2 }, { -1, -1 }, { 1, -1 }, { -2, 0 }, { 2, 0 }, { -1, 1 }, { 1, 1 }, { 0, 2 } } }, bestDx, bestDy);
+			break;
+		case SearchStrategy::hexagon:
+			search_pattern(std::array<std::array<int, 2>, 6>{ { { -1, -2 }, { 1, -2 }, { -2, 0 }, { 2, 0 }, { -1, 2 }, { 1, 2 } } }, bestDx, bestDy);
+			break;
+		case SearchStrategy::successive_elimination:
+			search_successive_elimination(bestDx, bestDy);
+			break;
+		}
+
+		const int best = cost(bestDx, bestDy);
+		const double mean = mean_sad(bestDx, bestDy);
+		if (mean <= 0) {
+			return false;
+		}
+
+		match.pos = c4::point<double>(x + blockSize / 2., y + blockSize / 2.);
+		match.shift = c4::point<double>(px + bestDx, py + bestDy);
+		if (std::abs(bestDx) < radius) {
+			match.shift.x += subpixel(cost(bestDx - 1, bestDy), best, cost(bestDx + 1, bestDy));
+		}
+		if (std::abs(bestDy) < radius) {
+			match.shift.y += subpixel(cost(bestDx, bestDy - 1), best, cost(bestDx, bestDy + 1));
+		}
+		match.weight = 1. - best / mean;
+
+		return true;
+	}
+
+	// Blocks of the grid worth matching: not ignored, with texture of at least minTexture, and at most the maxBlocks
+	// most textured ones. Flat blocks (sky, walls, motion blur) give unreliable matches that still cost a full search.
+	std::vector<bool> select_blocks(const std::vector<c4::rectangle<int>>& ignoreRects, int rows, int cols, int x0, int y0, bool textureFilter) {
+		struct Candidate {
+			int index;
+			double texture;
+		};
+
+		std::vector<Candidate> candidates;
+		for (int r = 0; r < rows; r++) {
+			for (int c = 0; c < cols; c++) {
+				const int x = x0 + c * blockSize;
+				const int y = y0 + r * blockSize;
+
+				if (std::any_of(ignoreRects.begin(), ignoreRects.end(), [&](const c4::rectangle<int>& rect) { return intersects(rect, x, y, blockSize); })) {
+					continue;
+				}
+
+				const double t = textureFilter ? texture(x, y) : 0.;
+				if (t < matchingParams.minTexture) {
+					texturelessBlocks++;
+					continue;
+				}
+
+				candidates.push_back({ r * cols + c, t });
+			}
+		}
+
+		if (matchingParams.maxBlocks > 0 && (int)candidates.size() > matchingParams.maxBlocks) {
+			std::nth_element(candidates.begin(), candidates.begin() + matchingParams.maxBlocks, candidates.end(), [](const Candidate& a, const Candidate& b) { return a.texture > b.texture; });
+			candidates.resize(matchingParams.maxBlocks);
+		}
+
+		std::vector<bool> selected(rows * cols, false);
+		for (const Candidate& candidate : candidates) {
+			selected[candidate.index] = true;
+		}
+		return selected;
+	}
+
+	// Matches all blocks of the grid. Without prediction the search is centered at zero shift,
+	// otherwise every block is searched around the position where the predicted motion moves it.
+	std::vector<BlockMatch> match_grid(const c4::VideoStabilization::Frame& prev, const c4::VideoStabilization::Frame& next, const std::vector<c4::rectangle<int>>& ignoreRects, const c4::MotionDetector::Motion* prediction, int radius) {
+		const int width = prev.width();
+		const int height = prev.height();
+		const c4::point<double> center(width / 2., height / 2.);
+
+		const int margin = prediction ? 0 : radius;
+		const int cols = std::max(0, (width - 2 * margin) / blockSize);
+		const int rows = std::max(0, (height - 2 * margin) / blockSize);
+		const int x0 = (width - cols * blockSize) / 2;
+		const int y0 = (height - rows * blockSize) / 2;
+
+		const bool textureFilter = matchingParams.minTexture > 0 || matchingParams.maxBlocks > 0;
+		if (matchingParams.search == SearchStrategy::successive_elimination || textureFilter) {
+			integrate<uint32_t, false>(prev, prevIntegral);
+		}
+		if (matchingParams.search == SearchStrategy::successive_elimination) {
+			integrate<uint32_t, false>(next, nextIntegral);
+		}
+		if (textureFilter) {
+			integrate<uint64_t, true>(prev, prevSquaresIntegral);
+		}
+
+		const std::vector<bool> selected = select_blocks(ignoreRects, rows, cols, x0, y0, textureFilter);
+
+		// Integer shifts found for the blocks so far, neighbors are good start candidates
+		constexpr int unknown = std::numeric_limits<int>::min();
+		std::vector<std::array<int, 2>> gridShifts(rows * cols, { unknown, unknown });
+
+		std::vector<BlockMatch> matches;
+		for (int r = 0; r < rows; r++) {
+			for (int c = 0; c < cols; c++) {
+				const int x = x0 + c * blockSize;
+				const int y = y0 + r * blockSize;
+
+				if (!selected[r * cols + c]) {
+					continue;
+				}
+
+				int px = 0;
+				int py = 0;
+				if (prediction) {
+					const c4::point<double> p(x + blockSize / 2., y + blockSize / 2.);
+					const c4::point<double> moved = move_point(*prediction, p, center);
+					px = (int)std::lround(moved.x - p.x);
+					py = (int)std::lround(moved.y - p.y);
+				}
+
+				if (x + px - radius < 0 || x + px + radius + blockSize > width || y + py - radius < 0 || y + py + radius + blockSize > height) {
+					continue;
+				}
+
+				searchStarts.clear();
+				for (const auto& [nr, nc] : { std::array<int, 2>{ r, c - 1 }, std::array<int, 2>{ r - 1, c }, std::array<int, 2>{ r - 1, c + 1 } }) {
+					if (nr >= 0 && nc >= 0 && nc < cols && gridShifts[nr * cols + nc][0] != unknown) {
+						searchStarts.push_back({ gridShifts[nr * cols + nc][0] - px, gridShifts[nr * cols + nc][1] - py });
+					}
+				}
+
+				BlockMatch match;
+				if (match_block(prev, next, x, y, px, py, radius, match)) {
+					matches.push_back(match);
+					gridShifts[r * cols + c] = { (int)std::lround(match.shift.x), (int)std::lround(match.shift.y) };
+				}
+			}
+		}
+
+		return matches;
+	}
+
+	// Levels beyond the point where the coarsest frame fits fewer than 2x2 blocks are not used
+	int pyramid_levels(int width, int height) const {
+		int levels = 1;
+		while (levels < matchingParams.pyramidLevels && std::min(width >> levels, height >> levels) >= 2 * (blockSize + maxShift)) {
+			levels++;
+		}
+		return levels;
+	}
+
+	// Motion of the finest level. The coarsest level searches radius around the prediction, or around zero without one.
+	// The prediction is in prev frame pixels. Confidence is that of the coarsest level: finer levels only search
+	// refineRadius, a window too small for match weights to tell a good match from a poor one.
+	c4::MotionDetector::Motion detect_pyramid(const c4::VideoStabilization::Frame& prev, const c4::VideoStabilization::Frame& next, const std::vector<c4::rectangle<int>>& ignoreRects, const c4::MotionDetector::Motion* prediction, int radius) {
+		const int levels = pyramid_levels(prev.width(), prev.height());
+
+		std::vector<c4::VideoStabilization::FramePtr> prevPyramid;
+		std::vector<c4::VideoStabilization::FramePtr> nextPyramid;
+		for (int level = 1; level < levels; level++) {
+			prevPyramid.push_back(downscale_box(level == 1 ? prev : *prevPyramid.back(), 2));
+			nextPyramid.push_back(downscale_box(level == 1 ? next : *nextPyramid.back(), 2));
+		}
+
+		c4::MotionDetector::Motion motion;
+		double confidence = 0;
+		for (int level = levels - 1; level >= 0; level--) {
+			const c4::VideoStabilization::Frame& p = level ? *prevPyramid[level - 1] : prev;
+			const c4::VideoStabilization::Frame& n = level ? *nextPyramid[level - 1] : next;
+			const std::vector<c4::rectangle<int>> levelIgnoreRects = level ? downscale_rects(ignoreRects, 1 << level) : ignoreRects;
+
+			std::vector<BlockMatch> matches;
+			if (level == levels - 1) {
+				if (prediction) {
+					motion = rescaled(*prediction, prev.width(), p.width());
+					matches = match_grid(p, n, levelIgnoreRects, &motion, radius);
+				} else {
+					matches = match_grid(p, n, levelIgnoreRects, nullptr, radius);
+				}
+			} else {
+				motion.shift = c4::point<double>(motion.shift.x * 2, motion.shift.y * 2);
+				matches = match_grid(p, n, levelIgnoreRects, &motion, matchingParams.refineRadius);
+			}
+
+			motion = similarityFit(matches, c4::point<double>(p.width() / 2., p.height() / 2.));
+			if (level == levels - 1) {
+				confidence = motion.confidence;
+			} else if (!matches.empty()) {
+				motion.confidence = confidence;
+			}
+		}
+
+		return motion;
+	}
+
+	// Same motion for a frame of another width, e.g. a coarser analysis downscale
+	static c4::MotionDetector::Motion rescaled(const c4::MotionDetector::Motion& motion, int fromWidth, int toWidth) {
+		c4::MotionDetector::Motion m = motion;
+		const double k = double(toWidth) / fromWidth;
+		m.shift = c4::point<double>(motion.shift.x * k, motion.shift.y * k);
+		return m;
+	}
+
+public:
+	BlockMotionDetector(const c4::VideoStabilization::Params& params, const BlockMatchingParams& matchingParams)
+		: blockSize(params.blockSize), maxShift(params.maxShift), matchingParams(matchingParams), similarityFit(params.maxAlpha, params.maxScale, matchingParams.fit), sadFunction(best_sad_function(params.blockSize)), sadLimitFunction(best_sad_limit_function(params.blockSize))
+		, sceneCutThreshold(params.scene_cut_threshold), predictionRadius(params.maxShift) {
+		ASSERT_GREATER(blockSize, 0);
+		ASSERT_GREATER_EQUAL(maxShift, 0);
+		ASSERT_GREATER_EQUAL(matchingParams.refineRadius, 1);
+	}
+
+	c4::MotionDetector::Motion detect(const c4::VideoStabilization::Frame& prev, const c4::VideoStabilization::Frame& next, const std::vector<c4::rectangle<int>>& ignoreRects) {
+		ASSERT_EQUAL(prev.width(), next.width());
+		ASSERT_EQUAL(prev.height(), next.height());
+
+		if (!matchingParams.temporalPrediction) {
+			return detect_pyramid(prev, next, ignoreRects, nullptr, maxShift);
+		}
+
+		const c4::MotionDetector::Motion motion = predictionWidth > 0 ? detect_around(prev, next, ignoreRects, rescaled(prediction, predictionWidth, prev.width()), predictionRadius) : detect_pyramid(prev, next, ignoreRects, nullptr, maxShift);
+
+		if (motion.confidence < sceneCutThreshold) {
+			predictionWidth = 0;
+			predictionRadius = maxShift;
+		} else {
+			prediction = motion;
+			predictionWidth = prev.width();
+			predictionRadius = motion.confidence < reliableConfidence ? maxShift : std::max(std::min(matchingParams.minSearchRadius, maxShift), predictionRadius - predictionRadius / 4);
+		}
+
+		return motion;
+	}
+
+	// Searches radius around the predicted motion (in prev frame pixels). If the motion isn't there,
+	// a full search tells that apart from a real scene cut.
+	c4::MotionDetector::Motion detect_around(const c4::VideoStabilization::Frame& prev, const c4::VideoStabilization::Frame& next, const std::vector<c4::rectangle<int>>& ignoreRects, const c4::MotionDetector::Motion& prediction, int radius) {
+		c4::MotionDetector::Motion motion = detect_pyramid(prev, next, ignoreRects, &prediction, radius);
+		if (motion.confidence < reliableConfidence) {
+			const c4::MotionDetector::Motion full = detect_pyramid(prev, next, ignoreRects, nullptr, maxShift);
+			if (full.confidence > motion.confidence) {
+				motion = full;
+			}
+		}
+		return motion;
+	}
+
+	// Search cost statistics, to compare strategies
+	double average_sad_evaluations() const {
+		return searchedBlocks ? double(sadEvaluations) / searchedBlocks : 0.;
+	}
+
+	// Share of not ignored blocks skipped for having too little texture
+	double textureless_share() const {
+		return searchedBlocks + texturelessBlocks ? double(texturelessBlocks) / (searchedBlocks + texturelessBlocks) : 0.;
+	}
+};
+
+// Causal smoothing of the camera trajectory, turns raw frame to frame motions into stabilizing corrections.
+// Each component (x, y, log scale, alpha) is integrated into a trajectory which is followed by
+// Holt's linear exponential smoothing, so steady pans don't lag behind. The correction is the
+// difference between the trajectory and its smoothed version.
+class MotionSmoother {
+	class Component {
+		double a;
+		double b;
+		double position = 0;
+		double level = 0;
+		double trend = 0;
+
+	public:
+		Component(int smooth) : a(2. / (std::max(smooth, 1) + 1)), b(a) {}
+
+		void reset() {
+			position = level = trend = 0;
+		}
+
+		double push(double delta) {
+			position += delta;
+			const double prevLevel = level;
+			level = a * position + (1 - a) * (level + trend);
+			trend = b * (level - prevLevel) + (1 - b) * trend;
+			return position - level;
+		}
+	};
+
+	const double sceneCutThreshold;
+	Component x;
+	Component y;
+	Component scale;
+	Component alpha;
+
+public:
+	MotionSmoother(const c4::VideoStabilization::Params& params)
+		: sceneCutThreshold(params.scene_cut_threshold), x(params.x_smooth), y(params.y_smooth), scale(params.scale_smooth), alpha(params.alpha_smooth) {}
+
+	// Scene cuts restart the trajectory, the correction is identity with zero confidence
+	c4::MotionDetector::Motion push(const c4::MotionDetector::Motion& motion) {
+		c4::MotionDetector::Motion correction;
+		if (motion.confidence < sceneCutThreshold) {
+			x.reset();
+			y.reset();
+			scale.reset();
+			alpha.reset();
+			return correction;
+		}
+
+		correction.shift.x = x.push(motion.shift.x);
+		correction.shift.y = y.push(motion.shift.y);
+		correction.scale = std::exp(scale.push(std::log(motion.scale)));
+		correction.alpha = alpha.push(motion.alpha);
+		correction.confidence = motion.confidence;
+
+		return correction;
+	}
+};
@@ -0,0 +1,538 @@
+//MIT License
+//
+//Copyright(c) 2025 Alex Kasitskyi
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files(the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions :
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+#pragma once
+
+#include <cmath>
+#include <numbers>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <c4/video_stabilization.hpp>
+
+#include "cpu_dispatch.hpp"
+#include "motion_estimation.hpp"
+
+// Global motion by FFT phase correlation: the normalized cross power spectrum of two frames transforms back
+// to a peak at their relative shift, so the cost doesn't depend on how big the shift is.
+
+// Radix-2 FFT of a power of 2 size n, in place on separate real and imaginary planes. Runs count transforms
+// at once, sample i of transform c is at [i * stride + c], so they vectorize across transforms.
+// Count 0 means the count is taken from the argument, the others are unrolled.
+// Twiddles of the stage with half size h are at [h - 1, 2 * h - 1).
+template<int Count>
+FFSTAB_INLINE void fft_impl(float* re, float* im, int n, int stride, int count, const float* twiddleRe, const float* twiddleIm, const int* reversed) {
+	if (Count) {
+		count = Count;
+	}
+
+	for (int i = 0; i < n; i++) {
+		const int r = reversed[i];
+		if (i < r) {
+			std::swap_ranges(re + i * stride, re + i * stride + count, re + r * stride);
+			std::swap_ranges(im + i * stride, im + i * stride + count, im + r * stride);
+		}
+	}
+
+	for (int half = 1; half < n; half *= 2) {
+		for (int i = 0; i < n; i += 2 * half) {
+			for (int j = 0; j < half; j++) {
+				float* __restrict ar = re + (i + j) * stride;
+				float* __restrict ai = im + (i + j) * stride;
+				float* __restrict br = re + (i + j + half) * stride;
+				float* __restrict bi = im + (i + j + half) * stride;
+				const float wr = twiddleRe[half - 1 + j];
+				const float wi = twiddleIm[half - 1 + j];
+				for (int c = 0; c < count; c++) {
+					const float tr = br[c] * wr - bi[c] * wi;
+					const float ti = br[c] * wi + bi[c] * wr;
+					br[c] = ar[c] - tr;
+					bi[c] = ai[c] - ti;
+					ar[c] += tr;
+					ai[c] += ti;
+				}
+			}
+		}
+	}
+}
+
+typedef void (*FftFunction)(float* re, float* im, int n, int stride, int count, const float* twiddleRe, const float* twiddleIm, const int* reversed);
+
+template<int Count>
+inline void fft_scalar(float* re, float* im, int n, int stride, int count, const float* twiddleRe, const float* twiddleIm, const int* reversed) {
+	fft_impl<Count>(re, im, n, stride, count, twiddleRe, twiddleIm, reversed);
+}
+
+#ifdef FFSTAB_TARGET_CLONES
+template<int Count>
+FFSTAB_TARGET_AVX2 inline void fft_avx2(float* re, float* im, int n, int stride, int count, const float* twiddleRe, const float* twiddleIm, const int* reversed) {
+	fft_impl<Count>(re, im, n, stride, count, twiddleRe, twiddleIm, reversed);
+}
+
+template<int Count>
+FFSTAB_TARGET_AVX512 inline void fft_avx512(float* re, float* im, int n, int stride, int count, const float* twiddleRe, const float* twiddleIm, const int* reversed) {
+	fft_impl<Count>(re, im, n, stride, count, twiddleRe, twiddleIm, reversed);
+}
+#endif
+
+template<int Count>
+FftFunction select_fft() {
+	return select_kernel<FftFunction>(fft_scalar<Count>, FFSTAB_CLONE(fft_avx2<Count>), FFSTAB_CLONE(fft_avx512<Count>));
+}
+
+class Fft {
+	int n = 0;
+	std::vector<float> twiddleRe;
+	std::vector<float> twiddleIm;
+	std::vector<int> reversed;
+
+public:
+	explicit Fft(int n = 1) : n(n), twiddleRe(std::max(n - 1, 1)), twiddleIm(std::max(n - 1, 1)), reversed(n) {
+		ASSERT_TRUE(n > 0 && (n & (n - 1)) == 0);
+
+		for (int half = 1; half < n; half *= 2) {
+			for (int j = 0; j < half; j++) {
+				const double a = -std::numbers::pi * j / half;
+				twiddleRe[half - 1 + j] = (float)std::cos(a);
+				twiddleIm[half - 1 + j] = (float)std::sin(a);
+			}
+		}
+
+		int bits = 0;
+		while ((1 << bits) < n) {
+			bits++;
+		}
+		for (int i = 0; i < n; i++) {
+			int r = 0;
+			for (int b = 0; b < bits; b++) {
+				r |= ((i >> b) & 1) << (bits - 1 - b);
+			}
+			reversed[i] = r;
+		}
+	}
+
+	int size() const {
+		return n;
+	}
+
+	// The inverse transform is the forward one with real and imaginary parts swapped, it's not normalized.
+	// Count is the number of transforms at once, they are unrolled for Count > 0.
+	template<int Count = 0>
+	void operator()(float* re, float* im, int stride, int count, bool inverse) const {
+		static const FftFunction kernel = select_fft<Count>();
+
+		if (inverse) {
+			std::swap(re, im);
+		}
+		kernel(re, im, n, stride, count, twiddleRe.data(), twiddleIm.data(), reversed.data());
+	}
+};
+
+// Phase correlation of two real images of power of 2 size. Both are transformed with a single complex FFT,
+// as the real and the imaginary part, and separated using the spectrum symmetry of real signals.
+class PhaseCorrelation {
+	const int width;
+	const int height;
+	const Fft rowFft;
+	const Fft columnFft;
+	std::vector<float> packedRe;
+	std::vector<float> packedIm;
+	std::vector<float> crossRe;
+	std::vector<float> crossIm;
+
+	// Rows are transformed in tiles of rowTile rows, transposed so they vectorize like columns
+	static constexpr int rowTile = 16;
+	std::vector<float> tileRe;
+	std::vector<float> tileIm;
+
+	void transform(std::vector<float>& re, std::vector<float>& im, bool inverse) {
+		for (int y0 = 0; y0 < height; y0 += rowTile) {
+			const int rows = std::min(rowTile, height - y0);
+			for (int r = 0; r < rows; r++) {
+				const float* rowRe = re.data() + (y0 + r) * width;
+				const float* rowIm = im.data() + (y0 + r) * width;
+				for (int x = 0; x < width; x++) {
+					tileRe[x * rowTile + r] = rowRe[x];
+					tileIm[x * rowTile + r] = rowIm[x];
+				}
+			}
+
+			// Rows past the end of the image are transformed too, but not stored
+			rowFft.operator()<rowTile>(tileRe.data(), tileIm.data(), rowTile, rowTile, inverse);
+
+			for (int r = 0; r < rows; r++) {
+				float* rowRe = re.data() + (y0 + r) * width;
+				float* rowIm = im.data() + (y0 + r) * width;
+				for (int x = 0; x < width; x++) {
+					rowRe[x] = tileRe[x * rowTile + r];
+					rowIm[x] = tileIm[x * rowTile + r];
+				}
+			}
+		}
+		columnFft(re.data(), im.data(), width, width, inverse);
+	}
+
+	// Calls f(index, aRe, aIm, bRe, bIm) with the spectra of a and b
+	template<class F>
+	void spectra(const std::vector<float>& a, const std::vector<float>& b, F f) {
+		packedRe = a;
+		packedIm = b;
+		transform(packedRe, packedIm, false);
+
+		// A(k) = (Z(k) + conj(Z(-k))) / 2, B(k) = (Z(k) - conj(Z(-k))) / 2i
+		for (int y = 0; y < height; y++) {
+			const int my = (height - y) & (height - 1);
+			for (int x = 0; x < width; x++) {
+				const int mx = (width - x) & (width - 1);
+				const int i = y * width + x;
+				const int m = my * width + mx;
+				f(i, 0.5f * (packedRe[i] + packedRe[m]), 0.5f * (packedIm[i] - packedIm[m]), 0.5f * (packedIm[i] + packedIm[m]), 0.5f * (packedRe[m] - packedRe[i]));
+			}
+		}
+	}
+
+	// The peak of a phase-only correlation is a sinc, so the offset follows from the ratio of the highest
+	// neighbor to the peak, d = neighbor / (neighbor + peak), see Foroosh et al., Extension of phase
+	// correlation to subpixel registration
+	static double subpixel(double left, double center, double right) {
+		if (right >= left && right > 0) {
+			return right / (right + center);
+		}
+		if (left > 0) {
+			return -left / (left + center);
+		}
+		return 0.;
+	}
+
+public:
+	struct Peak {
+		double x = 0;
+		double y = 0;
+		// 1 - second highest peak / highest peak
+		double confidence = 0;
+	};
+
+	PhaseCorrelation(int width, int height)
+		: width(width), height(height), rowFft(width), columnFft(height), packedRe(width * height), packedIm(width * height), crossRe(width * height), crossIm(width * height), tileRe(width * rowTile), tileIm(width * rowTile) {}
+
+	int get_width() const {
+		return width;
+	}
+
+	int get_height() const {
+		return height;
+	}
+
+	void magnitudes(const std::vector<float>& a, const std::vector<float>& b, std::vector<float>& magA, std::vector<float>& magB) {
+		magA.resize(packedRe.size());
+		magB.resize(packedRe.size());
+		spectra(a, b, [&](int i, float aRe, float aIm, float bRe, float bIm) {
+			magA[i] = std::sqrt(aRe * aRe + aIm * aIm);
+			magB[i] = std::sqrt(bRe * bRe + bIm * bIm);
+		});
+	}
+
+	// Shift of b relative to a, b(p) = a(p - shift), in (-size / 2, size / 2]
+	Peak correlate(const std::vector<float>& a, const std::vector<float>& b) {
+		// Normalized B * conj(A)
+		spectra(a, b, [&](int i, float aRe, float aIm, float bRe, float bIm) {
+			const float re = bRe * aRe + bIm * aIm;
+			const float im = bIm * aRe - bRe * aIm;
+			const float n = 1.f / (std::sqrt(re * re + im * im) + 1e-6f);
+			crossRe[i] = re * n;
+			crossIm[i] = im * n;
+		});
+		transform(crossRe, crossIm, true);
+
+		const int best = int(std::max_element(crossRe.begin(), crossRe.end()) - crossRe.begin());
+		const int bx = best % width;
+		const int by = best / width;
+
+		auto at = [&](int x, int y) {
+			return (double)crossRe[(y & (height - 1)) * width + (x & (width - 1))];
+		};
+
+		// Highest value away from the main peak
+		float second = 0;
+		for (int y = 0; y < height; y++) {
+			const int dy = std::min((y - by) & (height - 1), (by - y) & (height - 1));
+			const float* row = crossRe.data() + y * width;
+			if (dy > 2) {
+				second = std::max(second, *std::max_element(row, row + width));
+				continue;
+			}
+			for (int x = 0; x < width; x++) {
+				const int dx = std::min((x - bx) & (width - 1), (bx - x) & (width - 1));
+				if (dx > 2) {
+					second = std::max(second, row[x]);
+				}
+			}
+		}
+
+		Peak peak;
+		const double center = at(bx, by);
+		peak.x = (bx > width / 2 ? bx - width : bx) + subpixel(at(bx - 1, by), center, at(bx + 1, by));
+		peak.y = (by > height / 2 ? by - height : by) + subpixel(at(bx, by - 1), center, at(bx, by + 1));
+		peak.confidence = center > 0 ? std::clamp(1. - second / center, 0., 1.) : 0.;
+		return peak;
+	}
+};
+
+// Global shift by phase correlation of the whole analysis frame, with optional rotation and scale
+// from log-polar phase correlation of the magnitude spectra, which don't depend on the shift.
+class PhaseCorrelationDetector {
+	// Log-polar image size: angles over half a turn, the magnitude spectrum is symmetric
+	static constexpr int logPolarAngles = 256;
+	static constexpr int logPolarRadii = 128;
+	// Log-polar radius range in cycles per pixel
+	static constexpr double minRadius = 1. / 64;
+	static constexpr double maxRadius = 0.5;
+
+	const double maxAlpha;
+	const double maxScale;
+	const bool logPolar;
+
+	std::unique_ptr<PhaseCorrelation> translation;
+	PhaseCorrelation rotation;
+	int frameWidth = 0;
+	int frameHeight = 0;
+	// Centered part of the frame that is correlated
+	int usedWidth = 0;
+	int usedHeight = 0;
+	std::vector<float> windowX;
+	std::vector<float> windowY;
+	std::vector<float> a;
+	std::vector<float> b;
+
+	// FFT size for a frame dimension: the next power of 2, or the previous one when padding would waste
+	// more than a quarter. The window makes frame edges matter little, so cropping them loses little.
+	static int fft_size(int n) {
+		int p = 1;
+		while (p < n) {
+			p *= 2;
+		}
+		return p > n + n / 4 && p > 2 ? p / 2 : p;
+	}
+
+	static std::vector<float> hann(int n, int size) {
+		std::vector<float> w(size);
+		for (int i = 0; i < n; i++) {
+			w[i] = n > 1 ? float(0.5 - 0.5 * std::cos(2 * std::numbers::pi * i / (n - 1))) : 1.f;
+		}
+		return w;
+	}
+
+	void prepare(int height, int width) {
+		if (translation && frameWidth == width && frameHeight == height) {
+			return;
+		}
+		frameWidth = width;
+		frameHeight = height;
+		translation = std::make_unique<PhaseCorrelation>(fft_size(width), fft_size(height));
+		usedWidth = std::min(width, translation->get_width());
+		usedHeight = std::min(height, translation->get_height());
+		windowX = hann(usedWidth, translation->get_width());
+		windowY = hann(usedHeight, translation->get_height());
+		if (logPolar) {
+			prepare_log_polar();
+		}
+	}
+
+	// Windowed center of the frame with zero mean, zero padded to the FFT size, optionally moved by a motion
+	// without shift. Ignored rectangles are set to the mean, so they don't correlate.
+	void load(const c4::VideoStabilization::Frame& frame, const c4::MotionDetector::Motion* warp, const std::vector<c4::rectangle<int>>& ignoreRects, std::vector<float>& dst) const {
+		const int w = translation->get_width();
+		const int x0 = (frame.width() - usedWidth) / 2;
+		const int y0 = (frame.height() - usedHeight) / 2;
+		dst.assign((size_t)w * translation->get_height(), 0.f);
+
+		if (warp) {
+			// dst(p) = frame(inverse motion of p), bilinear with edge clamping
+			const double cx = frame.width() / 2.;
+			const double cy = frame.height() / 2.;
+			const double ca = std::cos(warp->alpha) / warp->scale;
+			const double sa = std::sin(warp->alpha) / warp->scale;
+			for (int y = 0; y < usedHeight; y++) {
+				for (int x = 0; x < usedWidth; x++) {
+					const double qx = x0 + x - cx;
+					const double qy = y0 + y - cy;
+					const double sx = std::clamp(cx + ca * qx + sa * qy, 0., frame.width() - 1.);
+					const double sy = std::clamp(cy - sa * qx + ca * qy, 0., frame.height() - 1.);
+					const int ix = std::min((int)sx, frame.width() - 2);
+					const int iy = std::min((int)sy, frame.height() - 2);
+					const double fx = sx - ix;
+					const double fy = sy - iy;
+					const uint8_t* r0 = frame[iy] + ix;
+					const uint8_t* r1 = frame[iy + 1] + ix;
+					dst[y * w + x] = float((r0[0] * (1 - fx) + r0[1] * fx) * (1 - fy) + (r1[0] * (1 - fx) + r1[1] * fx) * fy);
+				}
+			}
+		} else {
+			for (int y = 0; y < usedHeight; y++) {
+				const uint8_t* row = frame[y0 + y] + x0;
+				for (int x = 0; x < usedWidth; x++) {
+					dst[y * w + x] = row[x];
+				}
+			}
+		}
+
+		double sum = 0;
+		for (int y = 0; y < usedHeight; y++) {
+			for (int x = 0; x < usedWidth; x++) {
+				sum += dst[y * w + x];
+			}
+		}
+		const float mean = float(sum / ((double)usedWidth * usedHeight));
+
+		for (int y = 0; y < usedHeight; y++) {
+			for (int x = 0; x < usedWidth; x++) {
+				dst[y * w + x] = (dst[y * w + x] - mean) * windowX[x] * windowY[y];
+			}
+		}
+
+		for (const c4::rectangle<int>& r : ignoreRects) {
+			for (int y = std::max(r.y - y0, 0); y < std::min(r.y + r.h - y0, usedHeight); y++) {
+				for (int x = std::max(r.x - x0, 0); x < std::min(r.x + r.w - x0, usedWidth); x++) {
+					dst[y * w + x] = 0.f;
+				}
+			}
+		}
+	}
+
+	// Bilinear sample of the magnitude spectrum for a log-polar pixel, with the high-pass filter in the weights
+	struct LogPolarSample {
+		int index[4];
+		float weight[4];
+	};
+	std::vector<LogPolarSample> logPolarSamples;
+	std::vector<float> radiusWindow;
+
+	void prepare_log_polar() {
+		const int w = translation->get_width();
+		const int h = translation->get_height();
+		const double logBase = std::log(maxRadius / minRadius) / logPolarRadii;
+
+		logPolarSamples.resize((size_t)logPolarAngles * logPolarRadii);
+		for (int j = 0; j < logPolarRadii; j++) {
+			const double r = minRadius * std::exp(j * logBase);
+			for (int i = 0; i < logPolarAngles; i++) {
+				const double theta = std::numbers::pi * i / logPolarAngles;
+				const double u = r * std::cos(theta);
+				const double v = r * std::sin(theta);
+
+				// Suppresses low frequencies, which mostly come from the frame edges and the window
+				const double c = std::cos(std::numbers::pi * u) * std::cos(std::numbers::pi * v);
+				const double highPass = (1 - c) * (2 - c);
+
+				const double kx = u * w;
+				const double ky = v * h;
+				const int x0 = (int)std::floor(kx);
+				const int y0 = (int)std::floor(ky);
+				const double fx = kx - x0;
+				const double fy = ky - y0;
+
+				LogPolarSample& sample = logPolarSamples[j * logPolarAngles + i];
+				for (int k = 0; k < 4; k++) {
+					const int dx = k & 1;
+					const int dy = k >> 1;
+					sample.index[k] = ((y0 + dy) & (h - 1)) * w + ((x0 + dx) & (w - 1));
+					sample.weight[k] = float(highPass * (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy));
+				}
+			}
+		}
+
+		// Angles wrap around, radii don't, so only the radius gets a window
+		radiusWindow = hann(logPolarRadii, logPolarRadii);
+	}
+
+	// High-pass filtered magnitude spectrum resampled to angle (x) and log radius (y), with zero mean.
+	// Rotation moves it along x, scaling along y.
+	std::vector<float> log_polar(const std::vector<float>& magnitude) const {
+		std::vector<float> lp(logPolarSamples.size());
+		double sum = 0;
+		for (size_t i = 0; i < lp.size(); i++) {
+			const LogPolarSample& sample = logPolarSamples[i];
+			lp[i] = magnitude[sample.index[0]] * sample.weight[0] + magnitude[sample.index[1]] * sample.weight[1] + magnitude[sample.index[2]] * sample.weight[2] + magnitude[sample.index[3]] * sample.weight[3];
+			sum += lp[i];
+		}
+
+		const float mean = float(sum / lp.size());
+		for (int j = 0; j < logPolarRadii; j++) {
+			for (int i = 0; i < logPolarAngles; i++) {
+				lp[j * logPolarAngles + i] = (lp[j * logPolarAngles + i] - mean) * radiusWindow[j];
+			}
+		}
+
+		return lp;
+	}
+
+	// Rotation and scale of next relative to prev moved by the motion so far
+	c4::MotionDetector::Motion rotation_scale(const c4::VideoStabilization::Frame& prev, const c4::VideoStabilization::Frame& next, const std::vector<c4::rectangle<int>>& ignoreRects, const c4::MotionDetector::Motion* motion) {
+		load(prev, motion, ignoreRects, a);
+		load(next, nullptr, ignoreRects, b);
+
+		std::vector<float> magPrev;
+		std::vector<float> magNext;
+		translation->magnitudes(a, b, magPrev, magNext);
+
+		const PhaseCorrelation::Peak peak = rotation.correlate(log_polar(magPrev), log_polar(magNext));
+
+		// Rotating the frame rotates the spectrum the same way, scaling it up shrinks the spectrum
+		c4::MotionDetector::Motion residual;
+		residual.alpha = std::numbers::pi * peak.x / logPolarAngles;
+		residual.scale = std::exp(-peak.y * std::log(maxRadius / minRadius) / logPolarRadii);
+		return residual;
+	}
+
+public:
+	PhaseCorrelationDetector(const c4::VideoStabilization::Params& params, bool logPolar)
+		: maxAlpha(params.maxAlpha), maxScale(params.maxScale), logPolar(logPolar), rotation(logPolarAngles, logPolarRadii) {}
+
+	c4::MotionDetector::Motion detect(const c4::VideoStabilization::Frame& prev, const c4::VideoStabilization::Frame& next, const std::vector<c4::rectangle<int>>& ignoreRects) {
+		STATIC_SCOPED_TIMER("PhaseCorrelationDetector::detect()");
+
+		ASSERT_EQUAL(prev.width(), next.width());
+		ASSERT_EQUAL(prev.height(), next.height());
+		prepare(prev.height(), prev.width());
+
+		c4::MotionDetector::Motion motion;
+		const bool rotated = logPolar && prev.width() >= 2 && prev.height() >= 2;
+		if (rotated) {
+			// The estimate is biased towards no motion, because the window and the frame edges don't move,
+			// so it's repeated once on prev moved by the first estimate
+			motion = rotation_scale(prev, next, ignoreRects, nullptr);
+			const c4::MotionDetector::Motion residual = rotation_scale(prev, next, ignoreRects, &motion);
+			motion.alpha = std::clamp(motion.alpha + residual.alpha, -maxAlpha, maxAlpha);
+			motion.scale = std::clamp(motion.scale * residual.scale, 1. / maxScale, maxScale);
+		}
+
+		// The shift left after moving prev by the rotation and scale around the center
+		load(prev, rotated ? &motion : nullptr, ignoreRects, a);
+		load(next, nullptr, ignoreRects, b);
+		const PhaseCorrelation::Peak peak = translation->correlate(a, b);
+
+		motion.shift = c4::point<double>(peak.x, peak.y);
+		motion.confidence = peak.confidence;
+		return motion;
+	}
+};
@@ -0,0 +1,825 @@
+//MIT License
+//
+//Copyright(c) 2025 Alex Kasitskyi
+//
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files(the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions :
+//
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+//
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <bit>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include <c4/video_stabilization.hpp>
+
+#include "cpu_dispatch.hpp"
+
+// Warp of a plane by a motion: destination pixel p takes the source value at
+// center + scale * rotate(p - center, alpha) + shift, samples outside the plane are clamped to the edge.
+//
+// Source coordinates are stepped along a row in 16.16 fixed point, and re-anchored in double precision
+// every warpChunk pixels, so the stepping error stays below 0.001 pixel. Interpolation weights have 8 bits,
+// and the whole interpolation is done in 32 bit integers for both 8 and 16 bit samples.
+//
+// Row kernels are specialized on sample type, interpolation and transform class, and come in two versions:
+// chunks whose source coordinates all fall inside the plane use one without any clamping, the others
+// one that clamps. Every kernel version gives exactly the same result as the scalar one.
+
+constexpr int warpChunk = 64;
+constexpr int warpBandRows = 16;
+
+enum class WarpInterpolation {
+	nearest,
+	bilinear
+};
+
+enum class WarpTransform {
+	// No rotation and no scale: every pixel of a row has the same fractional offset, and samples are contiguous
+	translation,
+	// Any rotation and scale, samples are gathered
+	general
+};
+
+// Source coordinates of a chunk, and the plane they are read from
+struct WarpRow {
+	const uint8_t* src;
+	int stride;
+	// (width - 1) and (height - 1) in fixed point
+	int32_t maxX;
+	int32_t maxY;
+	// Last column and row a 2x2 neighborhood can start at
+	int32_t lastX;
+	int32_t lastY;
+	int32_t x;
+	int32_t y;
+	int32_t dx;
+	int32_t dy;
+};
+
+typedef void (*WarpRowFunction)(const WarpRow& row, uint8_t* dst, int count);
+
+template<class T, WarpInterpolation I, bool Border>
+FFSTAB_INLINE T warp_pixel(const WarpRow& row, int32_t x, int32_t y) {
+	if constexpr (Border) {
+		x = std::clamp(x, 0, row.maxX);
+		y = std::clamp(y, 0, row.maxY);
+	}
+
+	if constexpr (I == WarpInterpolation::nearest) {
+		return ((const T*)(row.src + size_t((y + 32768) >> 16) * row.stride))[(x + 32768) >> 16];
+	} else {
+		const int32_t ix = Border ? std::min(x >> 16, row.lastX) : x >> 16;
+		const int32_t iy = Border ? std::min(y >> 16, row.lastY) : y >> 16;
+		const uint32_t fx = uint32_t(x - (ix << 16)) >> 8;
+		const uint32_t fy = uint32_t(y - (iy << 16)) >> 8;
+
+		const T* r0 = (const T*)(row.src + (size_t)iy * row.stride) + ix;
+		const T* r1 = (const T*)((const uint8_t*)r0 + row.stride);
+		const uint32_t top = r0[0] * (256 - fx) + r0[1] * fx;
+		const uint32_t bottom = r1[0] * (256 - fx) + r1[1] * fx;
+		return T((top * (256 - fy) + bottom * fy + 32768) >> 16);
+	}
+}
+
+template<class T, WarpInterpolation I, WarpTransform Tr, bool Border>
+FFSTAB_INLINE void warp_row_impl(const WarpRow& row, uint8_t* dst, int count) {
+	T* d = (T*)dst;
+	if constexpr (Tr == WarpTransform::translation && !Border) {
+		if constexpr (I == WarpInterpolation::nearest) {
+			const T* r = (const T*)(row.src + size_t((row.y + 32768) >> 16) * row.stride) + ((row.x + 32768) >> 16);
+			std::copy(r, r + count, d);
+		} else {
+			const int32_t ix = row.x >> 16;
+			const int32_t iy = row.y >> 16;
+			const uint32_t fx = uint32_t(row.x & 0xffff) >> 8;
+			const uint32_t fy = uint32_t(row.y & 0xffff) >> 8;
+			const T* r0 = (const T*)(row.src + (size_t)iy * row.stride) + ix;
+			const T* r1 = (const T*)((const uint8_t*)r0 + row.stride);
+			for (int j = 0; j < count; j++) {
+				const uint32_t top = r0[j] * (256 - fx) + r0[j + 1] * fx;
+				const uint32_t bottom = r1[j] * (256 - fx) + r1[j + 1] * fx;
+				d[j] = T((top * (256 - fy) + bottom * fy + 32768) >> 16);
+			}
+		}
+	} else {
+		for (int j = 0; j < count; j++) {
+			d[j] = warp_pixel<T, I, Border>(row, row.x + j * row.dx, row.y + j * row.dy);
+		}
+	}
+}
+
+template<class T, WarpInterpolation I, WarpTransform Tr, bool Border>
+void warp_row_scalar(const WarpRow& row, uint8_t* dst, int count) {
+	warp_row_impl<T, I, Tr, Border>(row, dst, count);
+}
+
+#ifdef FFSTAB_TARGET_CLONES
+
+// Bilinear interpolation with gathered samples, both samples of a row of the neighborhood come from one 32 bit gather.
+// For 8 bit samples that reads 2 bytes past the neighborhood, so border chunks do lanes near the right edge
+// of the plane one by one. Interior chunks are at least that far from it.
+template<class T, bool Border>
+FFSTAB_TARGET_AVX2 void warp_gather_avx2(const WarpRow& row, uint8_t* dst, int count) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i maxX = _mm256_set1_epi32(row.maxX);
+	const __m256i maxY = _mm256_set1_epi32(row.maxY);
+	const __m256i lastX = _mm256_set1_epi32(row.lastX);
+	const __m256i lastY = _mm256_set1_epi32(row.lastY);
+	const __m256i safeX = _mm256_set1_epi32(sizeof(T) == 1 ? row.lastX - 2 : row.lastX);
+	const __m256i stride = _mm256_set1_epi32(row.stride);
+	const __m256i full = _mm256_set1_epi32(256);
+	const __m256i round = _mm256_set1_epi32(32768);
+	const __m256i sampleMask = _mm256_set1_epi32(sizeof(T) == 1 ? 0xff : 0xffff);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	__m256i x = _mm256_add_epi32(_mm256_set1_epi32(row.x), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(row.dx)));
+	__m256i y = _mm256_add_epi32(_mm256_set1_epi32(row.y), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(row.dy)));
+	const __m256i stepX = _mm256_set1_epi32(8 * row.dx);
+	const __m256i stepY = _mm256_set1_epi32(8 * row.dy);
+
+	T* d = (T*)dst;
+	int j = 0;
+	for (; j + 8 <= count; j += 8, x = _mm256_add_epi32(x, stepX), y = _mm256_add_epi32(y, stepY)) {
+		__m256i cx = x;
+		__m256i cy = y;
+		__m256i ix = _mm256_srai_epi32(x, 16);
+		__m256i iy = _mm256_srai_epi32(y, 16);
+		if constexpr (Border) {
+			cx = _mm256_min_epi32(_mm256_max_epi32(x, zero), maxX);
+			cy = _mm256_min_epi32(_mm256_max_epi32(y, zero), maxY);
+			ix = _mm256_min_epi32(_mm256_srai_epi32(cx, 16), lastX);
+			iy = _mm256_min_epi32(_mm256_srai_epi32(cy, 16), lastY);
+
+			if (sizeof(T) == 1 && _mm256_movemask_epi8(_mm256_cmpgt_epi32(ix, safeX))) {
+				for (int k = 0; k < 8; k++) {
+					d[j + k] = warp_pixel<T, WarpInterpolation::bilinear, true>(row, row.x + (j + k) * row.dx, row.y + (j + k) * row.dy);
+				}
+				continue;
+			}
+		}
+
+		const __m256i fx = _mm256_srli_epi32(_mm256_sub_epi32(cx, _mm256_slli_epi32(ix, 16)), 8);
+		const __m256i fy = _mm256_srli_epi32(_mm256_sub_epi32(cy, _mm256_slli_epi32(iy, 16)), 8);
+		const __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(iy, stride), sizeof(T) == 1 ? ix : _mm256_slli_epi32(ix, 1));
+
+		const __m256i g0 = _mm256_i32gather_epi32((const int*)row.src, offset, 1);
+		const __m256i g1 = _mm256_i32gather_epi32((const int*)(row.src + row.stride), offset, 1);
+
+		const __m256i fx0 = _mm256_sub_epi32(full, fx);
+		const __m256i top = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(g0, sampleMask), fx0), _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(g0, 8 * sizeof(T)), sampleMask), fx));
+		const __m256i bottom = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(g1, sampleMask), fx0), _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(g1, 8 * sizeof(T)), sampleMask), fx));
+		const __m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(top, _mm256_sub_epi32(full, fy)), _mm256_mullo_epi32(bottom, fy)), round);
+		const __m256i v = _mm256_srli_epi32(sum, 16);
+
+		const __m256i v16 = _mm256_packus_epi32(v, v);
+		if (sizeof(T) == 1) {
+			const __m256i v8 = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(v16, v16), _mm256_setr_epi32(0, 4, 0, 4, 0, 4, 0, 4));
+			_mm_storel_epi64((__m128i*)(d + j), _mm256_castsi256_si128(v8));
+		} else {
+			_mm_storeu_si128((__m128i*)(d + j), _mm256_castsi256_si128(_mm256_permute4x64_epi64(v16, 0x08)));
+		}
+	}
+
+	for (; j < count; j++) {
+		d[j] = warp_pixel<T, WarpInterpolation::bilinear, Border>(row, row.x + j * row.dx, row.y + j * row.dy);
+	}
+}
+
+template<class T, bool Border>
+FFSTAB_TARGET_AVX512 void warp_gather_avx512(const WarpRow& row, uint8_t* dst, int count) {
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i maxX = _mm512_set1_epi32(row.maxX);
+	const __m512i maxY = _mm512_set1_epi32(row.maxY);
+	const __m512i lastX = _mm512_set1_epi32(row.lastX);
+	const __m512i lastY = _mm512_set1_epi32(row.lastY);
+	const __m512i safeX = _mm512_set1_epi32(sizeof(T) == 1 ? row.lastX - 2 : row.lastX);
+	const __m512i stride = _mm512_set1_epi32(row.stride);
+	const __m512i full = _mm512_set1_epi32(256);
+	const __m512i round = _mm512_set1_epi32(32768);
+	const __m512i sampleMask = _mm512_set1_epi32(sizeof(T) == 1 ? 0xff : 0xffff);
+	const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+	__m512i x = _mm512_add_epi32(_mm512_set1_epi32(row.x), _mm512_mullo_epi32(lanes, _mm512_set1_epi32(row.dx)));
+	__m512i y = _mm512_add_epi32(_mm512_set1_epi32(row.y), _mm512_mullo_epi32(lanes, _mm512_set1_epi32(row.dy)));
+	const __m512i stepX = _mm512_set1_epi32(16 * row.dx);
+	const __m512i stepY = _mm512_set1_epi32(16 * row.dy);
+
+	T* d = (T*)dst;
+	int j = 0;
+	for (; j + 16 <= count; j += 16, x = _mm512_add_epi32(x, stepX), y = _mm512_add_epi32(y, stepY)) {
+		__m512i cx = x;
+		__m512i cy = y;
+		__m512i ix = _mm512_srai_epi32(x, 16);
+		__m512i iy = _mm512_srai_epi32(y, 16);
+		if constexpr (Border) {
+			cx = _mm512_min_epi32(_mm512_max_epi32(x, zero), maxX);
+			cy = _mm512_min_epi32(_mm512_max_epi32(y, zero), maxY);
+			ix = _mm512_min_epi32(_mm512_srai_epi32(cx, 16), lastX);
+			iy = _mm512_min_epi32(_mm512_srai_epi32(cy, 16), lastY);
+
+			if (sizeof(T) == 1 && _mm512_cmpgt_epi32_mask(ix, safeX)) {
+				for (int k = 0; k < 16; k++) {
+					d[j + k] = warp_pixel<T, WarpInterpolation::bilinear, true>(row, row.x + (j + k) * row.dx, row.y + (j + k) * row.dy);
+				}
+				continue;
+			}
+		}
+
+		const __m512i fx = _mm512_srli_epi32(_mm512_sub_epi32(cx, _mm512_slli_epi32(ix, 16)), 8);
+		const __m512i fy = _mm512_srli_epi32(_mm512_sub_epi32(cy, _mm512_slli_epi32(iy, 16)), 8);
+		const __m512i offset = _mm512_add_epi32(_mm512_mullo_epi32(iy, stride), sizeof(T) == 1 ? ix : _mm512_slli_epi32(ix, 1));
+
+		const __m512i g0 = _mm512_i32gather_epi32(offset, (const void*)row.src, 1);
+		const __m512i g1 = _mm512_i32gather_epi32(offset, (const void*)(row.src + row.stride), 1);
+
+		const __m512i fx0 = _mm512_sub_epi32(full, fx);
+		const __m512i top = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_and_si512(g0, sampleMask), fx0), _mm512_mullo_epi32(_mm512_and_si512(_mm512_srli_epi32(g0, 8 * sizeof(T)), sampleMask), fx));
+		const __m512i bottom = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_and_si512(g1, sampleMask), fx0), _mm512_mullo_epi32(_mm512_and_si512(_mm512_srli_epi32(g1, 8 * sizeof(T)), sampleMask), fx));
+		const __m512i sum = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(top, _mm512_sub_epi32(full, fy)), _mm512_mullo_epi32(bottom, fy)), round);
+		const __m512i v = _mm512_srli_epi32(sum, 16);
+
+		if (sizeof(T) == 1) {
+			_mm_storeu_si128((__m128i*)(d + j), _mm512_cvtepi32_epi8(v));
+		} else {
+			_mm256_storeu_si256((__m256i*)(d + j), _mm512_cvtepi32_epi16(v));
+		}
+	}
+
+	for (; j < count; j++) {
+		d[j] = warp_pixel<T, WarpInterpolation::bilinear, Border>(row, row.x + j * row.dx, row.y + j * row.dy);
+	}
+}
+
+// Bilinear interpolation of a pure shift inside the plane: the weights are the same for every pixel and the
+// samples are contiguous, so the horizontal taps are one multiply-add of neighboring samples, and the vertical
+// ones a multiply by the fraction: top * (256 - fy) + bottom * fy = (top << 8) + (bottom - top) * fy.
+// 16 bit samples are biased to the signed range of the multiply-add, which doesn't change the result because
+// the weights sum to 256.
+
+// Samples widened to 16 bits, 16 bit ones biased to the signed range
+template<class T>
+FFSTAB_TARGET_AVX2 FFSTAB_INLINE __m256i warp_shift_load_avx2(const T* p) {
+	if constexpr (sizeof(T) == 1) {
+		return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+	} else {
+		return _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), _mm256_set1_epi16(-32768));
+	}
+}
+
+template<class T>
+FFSTAB_TARGET_AVX2 void warp_shift_avx2(const WarpRow& row, uint8_t* dst, int count) {
+	const uint32_t fx = uint32_t(row.x & 0xffff) >> 8;
+	const uint32_t fy = uint32_t(row.y & 0xffff) >> 8;
+	const T* r0 = (const T*)(row.src + size_t(row.y >> 16) * row.stride) + (row.x >> 16);
+	const T* r1 = (const T*)((const uint8_t*)r0 + row.stride);
+
+	const __m256i wx = _mm256_set1_epi32(int((fx << 16) | (256 - fx)));
+	const __m256i wy = _mm256_set1_epi32(fy);
+	const __m256i unbias = _mm256_set1_epi32(sizeof(T) == 1 ? 0 : 32768 * 256);
+	const __m256i round = _mm256_set1_epi32(32768);
+
+	T* d = (T*)dst;
+	int j = 0;
+	for (; j + 16 <= count; j += 16) {
+		const __m256i a0 = warp_shift_load_avx2(r0 + j);
+		const __m256i b0 = warp_shift_load_avx2(r0 + j + 1);
+		const __m256i a1 = warp_shift_load_avx2(r1 + j);
+		const __m256i b1 = warp_shift_load_avx2(r1 + j + 1);
+
+		// Unpacking within 128 bit lanes gives pixels 0-3, 8-11 and 4-7, 12-15, packing restores the order
+		__m256i v[2];
+		for (int k = 0; k < 2; k++) {
+			const __m256i p0 = k ? _mm256_unpackhi_epi16(a0, b0) : _mm256_unpacklo_epi16(a0, b0);
+			const __m256i p1 = k ? _mm256_unpackhi_epi16(a1, b1) : _mm256_unpacklo_epi16(a1, b1);
+			const __m256i top = _mm256_add_epi32(_mm256_madd_epi16(p0, wx), unbias);
+			const __m256i bottom = _mm256_add_epi32(_mm256_madd_epi16(p1, wx), unbias);
+			const __m256i sum = _mm256_add_epi32(_mm256_slli_epi32(top, 8), _mm256_mullo_epi32(_mm256_sub_epi32(bottom, top), wy));
+			v[k] = _mm256_srli_epi32(_mm256_add_epi32(sum, round), 16);
+		}
+
+		const __m256i v16 = _mm256_packus_epi32(v[0], v[1]);
+		if constexpr (sizeof(T) == 1) {
+			_mm_storeu_si128((__m128i*)(d + j), _mm_packus_epi16(_mm256_castsi256_si128(v16), _mm256_extracti128_si256(v16, 1)));
+		} else {
+			_mm256_storeu_si256((__m256i*)(d + j), v16);
+		}
+	}
+
+	WarpRow tail = row;
+	tail.x += j << 16;
+	warp_row_impl<T, WarpInterpolation::bilinear, WarpTransform::translation, false>(tail, (uint8_t*)(d + j), count - j);
+}
+
+template<class T>
+FFSTAB_TARGET_AVX512 FFSTAB_INLINE __m512i warp_shift_load_avx512(const T* p) {
+	if constexpr (sizeof(T) == 1) {
+		return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)p));
+	} else {
+		return _mm512_xor_si512(_mm512_loadu_si512(p), _mm512_set1_epi16(-32768));
+	}
+}
+
+template<class T>
+FFSTAB_TARGET_AVX512 void warp_shift_avx512(const WarpRow& row, uint8_t* dst, int count) {
+	const uint32_t fx = uint32_t(row.x & 0xffff) >> 8;
+	const uint32_t fy = uint32_t(row.y & 0xffff) >> 8;
+	const T* r0 = (const T*)(row.src + size_t(row.y >> 16) * row.stride) + (row.x >> 16);
+	const T* r1 = (const T*)((const uint8_t*)r0 + row.stride);
+
+	const __m512i wx = _mm512_set1_epi32(int((fx << 16) | (256 - fx)));
+	const __m512i wy = _mm512_set1_epi32(fy);
+	const __m512i unbias = _mm512_set1_epi32(sizeof(T) == 1 ? 0 : 32768 * 256);
+	const __m512i round = _mm512_set1_epi32(32768);
+
+	T* d = (T*)dst;
+	int j = 0;
+	for (; j + 32 <= count; j += 32) {
+		const __m512i a0 = warp_shift_load_avx512(r0 + j);
+		const __m512i b0 = warp_shift_load_avx512(r0 + j + 1);
+		const __m512i a1 = warp_shift_load_avx512(r1 + j);
+		const __m512i b1 = warp_shift_load_avx512(r1 + j + 1);
+
+		__m512i v[2];
+		for (int k = 0; k < 2; k++) {
+			const __m512i p0 = k ? _mm512_unpackhi_epi16(a0, b0) : _mm512_unpacklo_epi16(a0, b0);
+			const __m512i p1 = k ? _mm512_unpackhi_epi16(a1, b1) : _mm512_unpacklo_epi16(a1, b1);
+			const __m512i top = _mm512_add_epi32(_mm512_madd_epi16(p0, wx), unbias);
+			const __m512i bottom = _mm512_add_epi32(_mm512_madd_epi16(p1, wx), unbias);
+			const __m512i sum = _mm512_add_epi32(_mm512_slli_epi32(top, 8), _mm512_mullo_epi32(_mm512_sub_epi32(bottom, top), wy));
+			v[k] = _mm512_srli_epi32(_mm512_add_epi32(sum, round), 16);
+		}
+
+		const __m512i v16 = _mm512_packus_epi32(v[0], v[1]);
+		if constexpr (sizeof(T) == 1) {
+			_mm256_storeu_si256((__m256i*)(d + j), _mm512_cvtepi16_epi8(v16));
+		} else {
+			_mm512_storeu_si512(d + j, v16);
+		}
+	}
+
+	WarpRow tail = row;
+	tail.x += j << 16;
+	warp_row_impl<T, WarpInterpolation::bilinear, WarpTransform::translation, false>(tail, (uint8_t*)(d + j), count - j);
+}
+
+// Gathers and shifts are written by hand, everything else is auto-vectorized for the clone's instruction set
+template<class T, WarpInterpolation I, WarpTransform Tr, bool Border>
+FFSTAB_TARGET_AVX2 void warp_row_avx2(const WarpRow& row, uint8_t* dst, int count) {
+	if constexpr (I == WarpInterpolation::bilinear && Tr == WarpTransform::general) {
+		warp_gather_avx2<T, Border>(row, dst, count);
+	} else if constexpr (I == WarpInterpolation::bilinear && !Border) {
+		warp_shift_avx2<T>(row, dst, count);
+	} else {
+		warp_row_impl<T, I, Tr, Border>(row, dst, count);
+	}
+}
+
+template<class T, WarpInterpolation I, WarpTransform Tr, bool Border>
+FFSTAB_TARGET_AVX512 void warp_row_avx512(const WarpRow& row, uint8_t* dst, int count) {
+	if constexpr (I == WarpInterpolation::bilinear && Tr == WarpTransform::general) {
+		warp_gather_avx512<T, Border>(row, dst, count);
+	} else if constexpr (I == WarpInterpolation::bilinear && !Border) {
+		warp_shift_avx512<T>(row, dst, count);
+	} else {
+		warp_row_impl<T, I, Tr, Border>(row, dst, count);
+	}
+}
+
+#endif
+
+struct WarpKernels {
+	WarpRowFunction interior = nullptr;
+	WarpRowFunction border = nullptr;
+};
+
+template<class T, WarpInterpolation I, WarpTransform Tr>
+WarpKernels select_warp_kernels() {
+	WarpKernels kernels;
+	kernels.interior = select_kernel<WarpRowFunction>(warp_row_scalar<T, I, Tr, false>, FFSTAB_CLONE(warp_row_avx2<T, I, Tr, false>), FFSTAB_CLONE(warp_row_avx512<T, I, Tr, false>));
+	kernels.border = select_kernel<WarpRowFunction>(warp_row_scalar<T, I, Tr, true>, FFSTAB_CLONE(warp_row_avx2<T, I, Tr, true>), FFSTAB_CLONE(warp_row_avx512<T, I, Tr, true>));
+	return kernels;
+}
+
+// Drops rotation and zoom that move no pixel of a width x height plane by more than 1/1024 of a pixel,
+// a fraction the 8 bit interpolation weights can't represent anyway. Returns true if the motion is a pure shift.
+inline bool snap_to_translation(c4::MotionDetector::Motion& motion, int width, int height) {
+	const double radius = std::hypot(width, height) / 2;
+	const double deviation = std::hypot(motion.scale * std::cos(motion.alpha) - 1, motion.scale * std::sin(motion.alpha));
+	if (deviation * radius < 1. / 1024) {
+		motion.alpha = 0;
+		motion.scale = 1;
+		return true;
+	}
+	return false;
+}
+
+// Largest distance a pixel of a width x height frame moves by motion, which is in pixels of that frame
+inline double max_displacement(const c4::MotionDetector::Motion& motion, int width, int height) {
+	const double radius = std::hypot(width, height) / 2;
+	const double deviation = std::hypot(motion.scale * std::cos(motion.alpha) - 1, motion.scale * std::sin(motion.alpha));
+	return std::hypot(motion.shift.x, motion.shift.y) + deviation * radius;
+}
+
+inline WarpTransform warp_transform(const c4::MotionDetector::Motion& motion) {
+	return motion.alpha == 0 && motion.scale == 1 ? WarpTransform::translation : WarpTransform::general;
+}
+
+// Transform class of the warp of src into dst, a warp that also resizes is always a general one
+template<class T, class U>
+WarpTransform warp_transform(const c4::MotionDetector::Motion& motion, const c4::matrix_ref<T>& src, const c4::matrix_ref<U>& dst) {
+	return src.height() == dst.height() && src.width() == dst.width() ? warp_transform(motion) : WarpTransform::general;
+}
+
+// Kernels are picked once per plane rather than per pixel
+template<class T>
+WarpKernels warp_kernels(WarpTransform transform, WarpInterpolation interpolation) {
+	static const WarpKernels kernels[2][2] = {
+		{ select_warp_kernels<T, WarpInterpolation::nearest, WarpTransform::translation>(), select_warp_kernels<T, WarpInterpolation::nearest, WarpTransform::general>() },
+		{ select_warp_kernels<T, WarpInterpolation::bilinear, WarpTransform::translation>(), select_warp_kernels<T, WarpInterpolation::bilinear, WarpTransform::general>() },
+	};
+	return kernels[interpolation == WarpInterpolation::bilinear][transform == WarpTransform::general];
+}
+
+struct WarpKernelVersion {
+	std::string isa;
+	WarpKernels kernels;
+};
+
+// All versions of the kernels the CPU supports, the scalar one first and the fastest one last.
+// Arm builds use the scalar version, which the compiler vectorizes for NEON.
+template<class T, WarpInterpolation I, WarpTransform Tr>
+std::vector<WarpKernelVersion> warp_kernel_versions() {
+	std::vector<WarpKernelVersion> versions;
+	versions.push_back({ "scalar", { warp_row_scalar<T, I, Tr, false>, warp_row_scalar<T, I, Tr, true> } });
+#ifdef FFSTAB_TARGET_CLONES
+	const CpuIsa isa = cpu_isa();
+	if (isa == CpuIsa::avx2 || isa == CpuIsa::avx512) {
+		versions.push_back({ "avx2", { warp_row_avx2<T, I, Tr, false>, warp_row_avx2<T, I, Tr, true> } });
+	}
+	if (isa == CpuIsa::avx512) {
+		versions.push_back({ "avx512", { warp_row_avx512<T, I, Tr, false>, warp_row_avx512<T, I, Tr, true> } });
+	}
+#endif
+	return versions;
+}
+
+// Warps planes src[k] into dh x dw destinations in one pass: source coordinates are computed once for every
+// band of rows and used for all the planes, like the three of a 4:4:4 frame or the chroma planes of a 4:2:0 one.
+// Source planes all have the same size, at least 2x2. When it differs from the destination one the warp also
+// resizes, pixel centers of dst map to those of src scaled by the size ratio, and motion is in src pixels.
+// store(k, i, j, kernel, row, count) runs the kernel for count pixels of plane k from row i, column j.
+template<class T, class Store>
+void warp_planes_impl(const c4::MotionDetector::Motion& motion, const std::vector<c4::matrix_ref<T>>& src, int dh, int dw, const WarpKernels& kernels, Store store) {
+	const int h = src[0].height();
+	const int w = src[0].width();
+	ASSERT_TRUE(h >= 2 && w >= 2);
+
+	const double cx = w / 2.;
+	const double cy = h / 2.;
+	const double kx = double(w) / dw;
+	const double ky = double(h) / dh;
+	const double a = motion.scale * std::cos(motion.alpha);
+	const double b = motion.scale * std::sin(motion.alpha);
+
+	// Coordinates far outside the plane are clamped anyway, limiting them keeps the fixed point stepping in range
+	const double limit = 8192;
+	auto fixed = [&](double v, int size) {
+		return int32_t(std::lround(std::clamp(v, -limit, size + limit) * 65536));
+	};
+
+	WarpRow row;
+	row.maxX = (w - 1) << 16;
+	row.maxY = (h - 1) << 16;
+	row.lastX = w - 2;
+	row.lastY = h - 2;
+	row.dx = int32_t(std::lround(a * kx * 65536));
+	row.dy = int32_t(std::lround(b * kx * 65536));
+
+	// Interior chunks need no clamping, and their 8 bit gathers can read 2 samples past the neighborhood
+	const int32_t interiorX = (w - 3) << 16;
+	const int32_t interiorY = (h - 1) << 16;
+
+	// Coordinate map of a band of rows: start coordinates and kernel of each chunk. Planes go over the band
+	// one after another, which keeps the source rows of a plane in cache from one row to the next.
+	const int chunks = (dw + warpChunk - 1) / warpChunk;
+	const int mapSize = warpBandRows * chunks;
+	std::vector<int32_t> mapX(mapSize);
+	std::vector<int32_t> mapY(mapSize);
+	std::vector<WarpRowFunction> mapKernel(mapSize);
+
+	for (int band = 0; band < dh; band += warpBandRows) {
+		const int bandEnd = std::min(band + warpBandRows, dh);
+		for (int i = band; i < bandEnd; i++) {
+			const double qy = ky * (i + 0.5) - 0.5 - cy;
+			for (int c = 0; c < chunks; c++) {
+				const int j = c * warpChunk;
+				const int count = std::min(warpChunk, dw - j);
+				const double qx = kx * (j + 0.5) - 0.5 - cx;
+				const int32_t x = fixed(cx + a * qx - b * qy + motion.shift.x, w);
+				const int32_t y = fixed(cy + b * qx + a * qy + motion.shift.y, h);
+
+				// Coordinates are linear along the chunk, so its ends tell whether all of it is inside
+				const int32_t endX = x + (count - 1) * row.dx;
+				const int32_t endY = y + (count - 1) * row.dy;
+				const bool interior = std::min(x, endX) >= 0 && std::max(x, endX) < interiorX && std::min(y, endY) >= 0 && std::max(y, endY) < interiorY;
+
+				const int m = (i - band) * chunks + c;
+				mapX[m] = x;
+				mapY[m] = y;
+				mapKernel[m] = interior ? kernels.interior : kernels.border;
+			}
+		}
+
+		for (size_t k = 0; k < src.size(); k++) {
+			row.src = (const uint8_t*)src[k].data();
+			row.stride = src[k].stride() * sizeof(T);
+			for (int i = band; i < bandEnd; i++) {
+				for (int c = 0; c < chunks; c++) {
+					const int j = c * warpChunk;
+					const int m = (i - band) * chunks + c;
+					row.x = mapX[m];
+					row.y = mapY[m];
+					store(k, i, j, mapKernel[m], row, std::min(warpChunk, dw - j));
+				}
+			}
+		}
+	}
+}
+
+// Warps planes src[k] into dst[k], see warp_planes_impl(). Planes smaller than 2x2 fall back to c4.
+template<class T>
+void warp_planes(const c4::MotionDetector::Motion& motion, const std::vector<c4::matrix_ref<T>>& src, std::vector<c4::matrix_ref<T>>& dst, const WarpKernels& kernels) {
+	ASSERT_EQUAL(src.size(), dst.size());
+	if (src.empty()) {
+		return;
+	}
+
+	if (src[0].height() < 2 || src[0].width() < 2) {
+		for (size_t k = 0; k < src.size(); k++) {
+			motion.apply(src[k], dst[k]);
+		}
+		return;
+	}
+
+	warp_planes_impl(motion, src, dst[0].height(), dst[0].width(), kernels, [&](size_t k, int i, int j, WarpRowFunction kernel, const WarpRow& row, int count) {
+		kernel(row, (uint8_t*)(dst[k][i] + j), count);
+	});
+}
+
+// Conversion of warped samples from one bit depth to another
+struct SampleConversion {
+	int srcDepth = 8;
+	int dstDepth = 8;
+	// Ordered dither when reducing the depth, rounding otherwise
+	bool dither = false;
+};
+
+// 8x8 Bayer matrix, thresholds of the ordered dither
+constexpr uint8_t bayer8x8[8][8] = {
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+// Converts count samples at row i, column j of the destination. Increasing the depth shifts samples left,
+// which keeps limited range video in limited range.
+template<class T, class U>
+void convert_samples(const T* src, U* dst, int count, int i, int j, const SampleConversion& conversion) {
+	if (conversion.dstDepth >= conversion.srcDepth) {
+		const int shift = conversion.dstDepth - conversion.srcDepth;
+		for (int k = 0; k < count; k++) {
+			dst[k] = U(src[k] << shift);
+		}
+		return;
+	}
+
+	const int shift = conversion.srcDepth - conversion.dstDepth;
+	const uint32_t maxValue = (1u << conversion.dstDepth) - 1;
+	if (conversion.dither) {
+		// Thresholds are (2 * t + 1) / 128 of a destination step
+		const uint8_t* thresholds = bayer8x8[i & 7];
+		for (int k = 0; k < count; k++) {
+			const uint32_t offset = ((2u * thresholds[(j + k) & 7] + 1) << shift) >> 7;
+			dst[k] = U(std::min((src[k] + offset) >> shift, maxValue));
+		}
+	} else {
+		const uint32_t half = 1u << (shift - 1);
+		for (int k = 0; k < count; k++) {
+			dst[k] = U(std::min((src[k] + half) >> shift, maxValue));
+		}
+	}
+}
+
+// Warps planes src[k] into dst[k] converting the samples: a chunk is warped into a buffer
+// and converted from there, so the conversion takes no memory pass of its own
+template<class T, class U>
+void warp_planes(const c4::MotionDetector::Motion& motion, const std::vector<c4::matrix_ref<T>>& src, std::vector<c4::matrix_ref<U>>& dst, const WarpKernels& kernels, const SampleConversion& conversion) {
+	ASSERT_EQUAL(src.size(), dst.size());
+	if (src.empty()) {
+		return;
+	}
+
+	if (src[0].height() < 2 || src[0].width() < 2) {
+		for (size_t k = 0; k < src.size(); k++) {
+			c4::matrix<T> warped(dst[k].height(), dst[k].width());
+			motion.apply(src[k], warped);
+			for (int i = 0; i < warped.height(); i++) {
+				convert_samples(warped[i], dst[k][i], warped.width(), i, 0, conversion);
+			}
+		}
+		return;
+	}
+
+	T chunk[warpChunk];
+	warp_planes_impl(motion, src, dst[0].height(), dst[0].width(), kernels, [&](size_t k, int i, int j, WarpRowFunction kernel, const WarpRow& row, int count) {
+		kernel(row, (uint8_t*)chunk, count);
+		convert_samples(chunk, dst[k][i] + j, count, i, j, conversion);
+	});
+}
+
+template<class T>
+void warp_plane(const c4::MotionDetector::Motion& motion, const c4::matrix_ref<T>& src, c4::matrix_ref<T>& dst, const WarpKernels& kernels) {
+	std::vector<c4::matrix_ref<T>> dsts{ dst };
+	warp_planes(motion, { src }, dsts, kernels);
+}
+
+template<class T>
+void warp_plane(const c4::MotionDetector::Motion& motion, const c4::matrix_ref<T>& src, c4::matrix_ref<T>& dst, WarpInterpolation interpolation = WarpInterpolation::bilinear) {
+	warp_plane(motion, src, dst, warp_kernels<T>(warp_transform(motion, src, dst), interpolation));
+}
+
+// Warp of planes of the same size by a pure shift with translation kernels. Every row reads the same source
+// columns, so it's split once into the columns left and right of the plane, done by the border kernel,
+// and the span between them, done by the interior kernel in one call.
+template<class T>
+void warp_shift_planes(const c4::MotionDetector::Motion& motion, const std::vector<c4::matrix_ref<T>>& src, std::vector<c4::matrix_ref<T>>& dst, const WarpKernels& kernels) {
+	ASSERT_TRUE(warp_transform(motion) == WarpTransform::translation);
+	ASSERT_EQUAL(src.size(), dst.size());
+	if (src.empty()) {
+		return;
+	}
+
+	const int h = src[0].height();
+	const int w = src[0].width();
+	ASSERT_TRUE(dst[0].height() == h && dst[0].width() == w);
+	if (h < 2 || w < 4) {
+		for (size_t k = 0; k < src.size(); k++) {
+			motion.apply(src[k], dst[k]);
+		}
+		return;
+	}
+
+	// A shift by more than the plane size clamps every sample to the edge already
+	const int32_t shiftX = int32_t(std::lround(std::clamp(motion.shift.x, -w - 1., w + 1.) * 65536));
+	const int32_t shiftY = int32_t(std::lround(std::clamp(motion.shift.y, -h - 1., h + 1.) * 65536));
+
+	WarpRow row;
+	row.maxX = (w - 1) << 16;
+	row.maxY = (h - 1) << 16;
+	row.lastX = w - 2;
+	row.lastY = h - 2;
+	row.dx = 1 << 16;
+	row.dy = 0;
+
+	// Column j reads source columns j + (shiftX >> 16) and the next one
+	const int begin = std::clamp(-(shiftX >> 16), 0, w);
+	const int end = std::clamp(w - 1 - (shiftX >> 16), begin, w);
+
+	for (int i = 0; i < h; i++) {
+		row.y = (i << 16) + shiftY;
+		const int iy = row.y >> 16;
+		const bool inside = iy >= 0 && iy <= h - 2 && begin < end;
+
+		for (size_t k = 0; k < src.size(); k++) {
+			row.src = (const uint8_t*)src[k].data();
+			row.stride = src[k].stride() * sizeof(T);
+			uint8_t* d = (uint8_t*)dst[k][i];
+			if (!inside) {
+				row.x = shiftX;
+				kernels.border(row, d, w);
+				continue;
+			}
+
+			if (begin > 0) {
+				row.x = shiftX;
+				kernels.border(row, d, begin);
+			}
+			row.x = (begin << 16) + shiftX;
+			kernels.interior(row, d + begin * sizeof(T), end - begin);
+			if (end < w) {
+				row.x = (end << 16) + shiftX;
+				kernels.border(row, d + end * sizeof(T), w - end);
+			}
+		}
+	}
+}
+
+template<class T>
+void warp_shift(const c4::MotionDetector::Motion& motion, const c4::matrix_ref<T>& src, c4::matrix_ref<T>& dst, const WarpKernels& kernels) {
+	std::vector<c4::matrix_ref<T>> dsts{ dst };
+	warp_shift_planes(motion, { src }, dsts, kernels);
+}
+
+template<class T>
+void warp_shift(const c4::MotionDetector::Motion& motion, const c4::matrix_ref<T>& src, c4::matrix_ref<T>& dst) {
+	warp_shift(motion, src, dst, warp_kernels<T>(WarpTransform::translation, WarpInterpolation::bilinear));
+}
+
+// Average of factorY x factorX blocks, the prefilter of warps that downscale by those factors or more.
+// Block centers are where warp_planes() maps pixel centers of the smaller plane.
+template<class T>
+void box_downscale(const c4::matrix_ref<T>& src, int factorY, int factorX, c4::matrix<T>& dst) {
+	const int h = src.height() / factorY;
+	const int w = src.width() / factorX;
+	dst.resize(h, w);
+
+	const uint32_t area = factorY * factorX;
+	const bool pow2 = (area & (area - 1)) == 0;
+	const int areaBits = pow2 ? std::countr_zero(area) : 0;
+
+	std::vector<uint32_t> sums(w);
+	for (int i = 0; i < h; i++) {
+		std::fill(sums.begin(), sums.end(), 0);
+		for (int r = 0; r < factorY; r++) {
+			const T* s = src[i * factorY + r];
+			for (int j = 0; j < w; j++) {
+				for (int k = 0; k < factorX; k++) {
+					sums[j] += s[j * factorX + k];
+				}
+			}
+		}
+
+		T* d = dst[i];
+		if (pow2) {
+			for (int j = 0; j < w; j++) {
+				d[j] = T((sums[j] + area / 2) >> areaBits);
+			}
+		} else {
+			for (int j = 0; j < w; j++) {
+				d[j] = T((sums[j] + area / 2) / area);
+			}
+		}
+	}
+}
+
+// Copies a component of a frame into a plane: data points at its first sample, step is the distance
+// between samples in bytes, and samples are stored shifted left by shift bits
+template<class T>
+void read_component(const uint8_t* data, int linesize, int step, int shift, c4::matrix<T>& plane) {
+	for (int i = 0; i < plane.height(); i++) {
+		const uint8_t* s = data + (size_t)i * linesize;
+		T* d = plane[i];
+		if (step == sizeof(T) && shift == 0) {
+			std::copy((const T*)s, (const T*)s + plane.width(), d);
+			continue;
+		}
+		for (int j = 0; j < plane.width(); j++) {
+			d[j] = T(*(const T*)(s + (size_t)j * step) >> shift);
+		}
+	}
+}
+
+template<class T>
+void write_component(const c4::matrix_ref<T>& plane, uint8_t* data, int linesize, int step, int shift) {
+	for (int i = 0; i < plane.height(); i++) {
+		const T* s = plane[i];
+		uint8_t* d = data + (size_t)i * linesize;
+		for (int j = 0; j < plane.width(); j++) {
+			*(T*)(d + (size_t)j * step) = T(s[j] << shift);
+		}
+	}
+}
+
+template<class T>
+void fill_component(uint8_t* data, int linesize, int step, int shift, int height, int width, T value) {
+	for (int i = 0; i < height; i++) {
+		uint8_t* d = data + (size_t)i * linesize;
+		for (int j = 0; j < width; j++) {
+			*(T*)(d + (size_t)j * step) = T(value << shift);
+		}
+	}
+}